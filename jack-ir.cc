@@ -21,15 +21,20 @@
 #define _GNU_SOURCE
 #endif
 
-#include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef _WIN32
@@ -37,424 +42,463 @@
 #endif
 
 #include <algorithm>
+#include <deque>
 #include <string>
 #include <vector>
 
-#include <jack/jack.h>
-#include <sndfile.h>
+#include "jackir.h"
 
-#include "zita-convolver.h"
+static IrCapture* capture_session = NULL;
 
-using namespace IrJackZitaConvolver;
+static volatile bool daemon_run = false;
 
-static uint32_t n_ir      = 0;
-static uint32_t n_inputs  = 2;
-static uint32_t n_outputs = 2;
+/* optional JSON report, one line per capture */
+static int             report_fd   = -1;
+static bool            report_own  = false;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static bool     true_stereo      = false;
-static uint32_t true_stereo_pass = 1;
-
-static float** ir        = NULL;
-static float*  sweep_sin = NULL;
-static float*  sweep_inv = NULL;
-
-static uint32_t sweep_len = 0;
-static uint32_t irrec_len = 0;
-
-static uint32_t proc_pos = 0;
-static uint32_t proc_tot = 0;
-
-static jack_port_t** output_ports = NULL;
-static jack_port_t** input_ports  = NULL;
+static bool
+file_exists (std::string const& name)
+{
+	struct stat buffer;
+	return (stat (name.c_str (), &buffer) == 0);
+}
 
-static uint32_t roundtrip_latency = 0;
+/* parse a list of programs, e.g. "0-7,12,20-23" */
+static bool
+parse_programs (const char* arg, std::vector<int>& programs)
+{
+	const char* p = arg;
+	while (*p) {
+		char* e;
+		long  a = strtol (p, &e, 10);
+		long  b = a;
+		if (e == p) {
+			return false;
+		}
+		if (*e == '-') {
+			p = e + 1;
+			b = strtol (p, &e, 10);
+			if (e == p) {
+				return false;
+			}
+		}
+		if (a < 0 || b < a || b > 16383) {
+			return false;
+		}
+		for (long i = a; i <= b; ++i) {
+			programs.push_back (i);
+		}
+		if (*e == ',') {
+			++e;
+		} else if (*e) {
+			return false;
+		}
+		p = e;
+	}
+	return !programs.empty ();
+}
 
-static volatile enum {
-	Initialize,
-	Run,
-	Exit,
-	Abort
-} client_state = Initialize;
+/* insert a suffix before the file extension */
+static std::string
+suffix_filename (std::string const& fn, const char* suffix)
+{
+	size_t dot = fn.find_last_of ('.');
+	size_t sep = fn.find_last_of ('/');
+	if (dot == std::string::npos || (sep != std::string::npos && dot < sep)) {
+		return fn + suffix;
+	}
+	return fn.substr (0, dot) + suffix + fn.substr (dot);
+}
 
-static void
-process_multi_pass (jack_nframes_t n_samples)
+/* "ir.wav" -> "ir-012.wav" */
+static std::string
+program_filename (std::string const& fn, int program)
 {
-	assert (n_outputs == 2 && n_inputs == 2 && n_ir == 4);
-	bool fp = true_stereo_pass > 0;
+	char tmp[16];
+	snprintf (tmp, sizeof (tmp), "-%03d", program);
+	return suffix_filename (fn, tmp);
+}
 
-	if (proc_pos < sweep_len) {
-		uint32_t n_play = proc_pos + n_samples < sweep_len ? n_samples : sweep_len - proc_pos;
-		float*   out    = (float*)jack_port_get_buffer (output_ports[fp ? 0 : 1], n_samples);
-		memcpy (out, &sweep_sin[proc_pos], n_play * sizeof (float));
+/* one file per port group, "ir.wav" -> "ir-g01.wav", "ir-g02.wav", .. */
+static std::vector<std::string>
+group_filenames (std::string const& fn, size_t n_groups)
+{
+	std::vector<std::string> fns;
+	if (n_groups < 2) {
+		fns.push_back (fn);
+		return fns;
 	}
-
-	if (proc_pos < irrec_len) {
-		uint32_t n_rec = proc_pos + n_samples < irrec_len ? n_samples : irrec_len - proc_pos;
-		for (uint32_t n = 0; n < 2; ++n) {
-			float* in = (float*)jack_port_get_buffer (input_ports[n], n_samples);
-			memcpy (&ir[n + (fp ? 0 : 2)][proc_pos], in, n_rec * sizeof (float));
-		}
+	for (size_t g = 0; g < n_groups; ++g) {
+		char tmp[16];
+		snprintf (tmp, sizeof (tmp), "-g%02d", (int)g + 1);
+		fns.push_back (suffix_filename (fn, tmp));
 	}
+	return fns;
+}
 
-	proc_pos += n_samples;
+/* daemon mode: capture jobs are queued from a unix-socket and run in order */
+struct CaptureJob {
+	int                      fd;
+	uint32_t                 id;
+	std::vector<std::string> capt;
+	std::vector<std::string> play;
+	std::string              outfile;
+	std::string              rawfile;
+	bool                     true_stereo;
+	bool                     overwrite;
+	int                      latency;
+};
+
+static std::deque<CaptureJob*> job_queue;
+static pthread_mutex_t         job_lock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t          job_cond   = PTHREAD_COND_INITIALIZER;
+static int                     daemon_fd  = -1;
 
-	if (proc_pos > irrec_len + true_stereo_pass) {
-		if (fp) {
-			proc_pos         = 0;
-			true_stereo_pass = 0;
+static void
+json_string (std::string& out, const char* str)
+{
+	out += '"';
+	for (const char* c = str; *c; ++c) {
+		if (*c == '"' || *c == '\\') {
+			out += '\\';
+			out += *c;
+		} else if ((unsigned char)*c < 0x20) {
+			char tmp[8];
+			snprintf (tmp, sizeof (tmp), "\\u%04x", *c);
+			out += tmp;
 		} else {
-			client_state = Exit;
+			out += *c;
 		}
 	}
+	out += '"';
 }
 
 static void
-process_single_pass (jack_nframes_t n_samples)
+job_reply (CaptureJob const* job, const char* error, CaptureResult const* res, uint32_t rate)
 {
-	assert (n_inputs == n_ir);
+	char        tmp[256];
+	std::string msg;
 
-	if (proc_pos < sweep_len) {
-		uint32_t n_play = proc_pos + n_samples < sweep_len ? n_samples : sweep_len - proc_pos;
-		for (uint32_t n = 0; n < n_outputs; ++n) {
-			float* out = (float*)jack_port_get_buffer (output_ports[n], n_samples);
-			memcpy (out, &sweep_sin[proc_pos], n_play * sizeof (float));
-		}
-	}
+	snprintf (tmp, sizeof (tmp), "{\"id\":%u,\"status\":", job->id);
+	msg = tmp;
 
-	if (proc_pos < irrec_len) {
-		uint32_t n_rec = proc_pos + n_samples < irrec_len ? n_samples : irrec_len - proc_pos;
-		for (uint32_t n = 0; n < n_inputs; ++n) {
-			float* in = (float*)jack_port_get_buffer (input_ports[n], n_samples);
-			memcpy (&ir[n][proc_pos], in, n_rec * sizeof (float));
-		}
+	if (error) {
+		msg += "\"error\",\"message\":";
+		json_string (msg, error);
+	} else {
+		msg += "\"ok\",\"file\":";
+		json_string (msg, job->outfile.c_str ());
+		snprintf (tmp, sizeof (tmp),
+		          ",\"channels\":%u,\"length\":%u,\"rate\":%u,\"peak_db\":%.2f,\"gain_db\":%.2f,\"latency\":%d",
+		          res->n_channels, res->ir_len, rate,
+		          20 * log10f (res->peak), 20 * log10f (res->gain), res->latency);
+		msg += tmp;
 	}
+	msg += "}\n";
 
-	proc_pos += n_samples;
-
-	if (proc_pos > irrec_len) {
-		client_state = Exit;
+	if (write (job->fd, msg.c_str (), msg.size ()) != (ssize_t)msg.size ()) {
+		fprintf (stderr, "Cannot send reply for job %u\n", job->id);
 	}
 }
 
-static int
-jack_process (jack_nframes_t n_samples, void* arg)
+/* dB value, or null if unknown */
+static void
+json_db (std::string& out, const char* key, double v, double scale)
 {
-	for (uint32_t n = 0; n < n_outputs; ++n) {
-		float* out = (float*)jack_port_get_buffer (output_ports[n], n_samples);
-		memset (out, 0, sizeof (float) * n_samples);
+	char tmp[64];
+	if (v > 0) {
+		snprintf (tmp, sizeof (tmp), ",\"%s\":%.2f", key, scale * log10 (v));
+	} else {
+		snprintf (tmp, sizeof (tmp), ",\"%s\":null", key);
 	}
+	out += tmp;
+}
+
+/* append one JSON line per capture to the report */
+static void
+report_emit (std::string const& fn, const char* error, CaptureResult const* res, uint32_t rate)
+{
+	char        tmp[256];
+	std::string msg;
 
-	if (client_state != Run) {
-		return 0;
+	if (report_fd < 0) {
+		return;
 	}
 
-	if (true_stereo) {
-		process_multi_pass (n_samples);
+	msg = "{\"file\":";
+	json_string (msg, fn.c_str ());
+	if (error) {
+		msg += ",\"status\":\"error\",\"message\":";
+		json_string (msg, error);
 	} else {
-		process_single_pass (n_samples);
+		msg += ",\"status\":\"ok\"";
 	}
 
-	proc_tot += n_samples;
-	return 0;
-}
+	snprintf (tmp, sizeof (tmp),
+	          ",\"rate\":%u,\"channels\":%u,\"length\":%u,\"length_sec\":%.3f",
+	          rate, res->n_channels, res->ir_len, res->ir_len / (double)rate);
+	msg += tmp;
+
+	json_db (msg, "peak_db", res->peak, 20);
+	json_db (msg, "gain_db", res->gain, 20);
+	json_db (msg, "snr_db", res->snr, 10);
+	json_db (msg, "noise_floor_db", res->noise, 20);
+	json_db (msg, "input_noise_db", res->in_noise, 20);
+
+	snprintf (tmp, sizeof (tmp),
+	          ",\"latency\":{\"used\":%d,\"reported\":%d,\"measured\":%d}",
+	          res->latency, res->latency_rt, res->latency_ir);
+	msg += tmp;
+
+	msg += ",\"stages\":{";
+	for (int i = 0; i < N_STAGES; ++i) {
+		snprintf (tmp, sizeof (tmp), "%s\"%s\":{\"wall\":%.4f,\"cpu\":%.4f}",
+		          i > 0 ? "," : "", stage_name[i], res->t[i].wall, res->t[i].cpu);
+		msg += tmp;
+	}
+	msg += "}}\n";
 
-static int
-jack_xrun (void* arg)
-{
-	fprintf (stderr, "JACK x-run, aborting\n");
-	client_state = Abort;
-	return 0;
+	pthread_mutex_lock (&report_lock);
+	if (write (report_fd, msg.c_str (), msg.size ()) != (ssize_t)msg.size ()) {
+		fprintf (stderr, "Cannot write report\n");
+	}
+	pthread_mutex_unlock (&report_lock);
 }
 
+/* send the reply and close the connection */
 static void
-jack_shutdown (void* arg)
+job_done (CaptureJob* job, const char* error, CaptureResult const* res, uint32_t rate)
 {
-	fprintf (stderr, "JACK terminated, aborting\n");
-	client_state = Abort;
+	job_reply (job, error, res, rate);
+	close (job->fd);
+	delete job;
 }
 
-static int
-jack_graph_order_cb (void* arg)
+/* result callback, called by the session's worker threads */
+static void
+capture_done (void* arg, void* user, const char* file, CaptureResult const* res, uint32_t rate)
 {
-	uint32_t worst_capture  = 0;
-	uint32_t worst_playback = 0;
-	for (uint32_t n = 0; n < n_inputs; ++n) {
-		jack_latency_range_t lr;
-		jack_port_get_latency_range (input_ports[n], JackCaptureLatency, &lr);
-		if (lr.max > worst_capture) {
-			worst_capture = lr.max;
-		}
-	}
-	for (uint32_t n = 0; n < n_outputs; ++n) {
-		jack_latency_range_t lr;
-		jack_port_get_latency_range (output_ports[n], JackPlaybackLatency, &lr);
-		if (lr.max > worst_playback) {
-			worst_playback = lr.max;
-		}
+	report_emit (file, res->error, res, rate);
+	if (user) {
+		job_done ((CaptureJob*)user, res->error, res, rate);
 	}
-	roundtrip_latency = worst_capture + worst_playback;
-	return 0;
 }
 
-static int
-sf_write (const char* fn, uint32_t n_channels, uint32_t rate, uint32_t off_start, uint32_t n_frames, float** data)
+static void
+capture_progress (void* arg, float progress, char phase)
 {
-	SNDFILE* file;
-	SF_INFO  sfinfo;
-
-	memset (&sfinfo, 0, sizeof (sfinfo));
-
-	if (n_channels > 4) {
-		return -1;
-	}
-
-	sfinfo.samplerate = rate;
-	sfinfo.frames     = n_frames;
-	sfinfo.channels   = n_channels;
-	sfinfo.format     = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
-
-	if (!(file = sf_open (fn, SFM_WRITE, &sfinfo))) {
-		fprintf (stderr, "Error: Not able to open output file '%s'.\n", fn);
-		return -1;
-	}
-
-	for (uint32_t f = off_start; f < off_start + n_frames; ++f) {
-		float frame[4];
-		for (uint32_t c = 0; c < n_channels; ++c) {
-			frame[c] = data[c][f];
-		}
-		if (1 != sf_writef_float (file, frame, 1)) {
-			fprintf (stderr, "Error wrting file '%s': %s\n", fn, sf_strerror (file));
-			sf_close (file);
-			return -2;
-		}
-	}
-
-	sf_close (file);
-	return 0;
+	printf ("Processing: %3.0f%% (%c) \r", progress, phase);
+	fflush (stdout);
 }
 
-static int
-convolv (uint32_t n_channels, uint32_t n_samples, float** data)
+/* parse "key=value" tokens: capture=<port> playback=<port> out=<file>
+ * true-stereo=1 overwrite=1 latency=<spl> raw=<file>
+ */
+static const char*
+job_parse (char* line, CaptureJob* job)
 {
-	Convproc p;
-
-	int rv = p.configure (
-	    /* in */ n_channels,
-	    /* out */ n_channels,
-	    /* max-convolution length */ sweep_len,
-	    /* quantum, nominal-buffersize */ Convproc::MAXPART,
-	    /* Convproc::MINPART */ Convproc::MAXPART,
-	    /* Convproc::MAXPART */ Convproc::MAXPART,
-	    /* density */ 0);
-
-	if (rv != 0) {
-		return rv;
-	}
-
-	rv = p.impdata_create (
-	    /*i/o map */ 0, 0,
-	    /*stride, de-interleave */ 1,
-	    sweep_inv,
-	    0, sweep_len);
-
-	if (rv != 0) {
-		return rv;
-	}
-
-	for (uint32_t c = 1; c < n_channels; ++c) {
-		if (p.impdata_link (0, 0, c, c)) {
-			return -1;
+	char* save = NULL;
+	for (char* tok = strtok_r (line, " \t\r\n", &save); tok; tok = strtok_r (NULL, " \t\r\n", &save)) {
+		char* val = strchr (tok, '=');
+		if (!val) {
+			return "Invalid token, expected key=value";
+		}
+		*val++ = '\0';
+		if (!strcmp (tok, "capture")) {
+			job->capt.push_back (val);
+		} else if (!strcmp (tok, "playback")) {
+			job->play.push_back (val);
+		} else if (!strcmp (tok, "out")) {
+			job->outfile = val;
+		} else if (!strcmp (tok, "raw")) {
+			job->rawfile = val;
+		} else if (!strcmp (tok, "true-stereo")) {
+			job->true_stereo = atoi (val) != 0;
+		} else if (!strcmp (tok, "overwrite")) {
+			job->overwrite = atoi (val) != 0;
+		} else if (!strcmp (tok, "latency")) {
+			job->latency = atoi (val);
+		} else {
+			return "Unknown key";
 		}
 	}
 
-	if (p.start_process (0, 0)) {
-		return -1;
+	if (job->outfile.empty ()) {
+		return "No output file given";
 	}
-
-	if (p.state () != Convproc::ST_PROC) {
-		return -1;
+	if (job->play.size () < 1 || job->play.size () > 2 || job->capt.size () < 1 || job->capt.size () > 2 || job->play.size () > job->capt.size ()) {
+		return "Invalid number of i/o ports";
 	}
+	if (job->true_stereo && (job->play.size () != 2 || job->capt.size () != 2)) {
+		return "True-Stereo needs stereo I/O";
+	}
+	return NULL;
+}
 
-	uint32_t off      = 0;
-	uint32_t n_remain = n_samples;
-
-	while (n_remain > 0) {
-		uint32_t n = std::min (n_remain, (uint32_t)Convproc::MAXPART);
+static void*
+daemon_listen (void* arg)
+{
+	uint32_t job_id = 0;
 
-		for (uint32_t c = 0; c < n_channels; ++c) {
-			float* const in = p.inpdata (c);
-			if (n < Convproc::MAXPART) {
-				memset (in, 0, sizeof (float) * Convproc::MAXPART);
+	while (daemon_run) {
+		int fd = accept (daemon_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
-			memcpy (in, &data[c][off], sizeof (float) * n);
-		}
-
-		p.process ();
-
-		for (uint32_t c = 0; c < n_channels; ++c) {
-			float const* const out = p.outdata (c);
-			memcpy (&data[c][off], out, sizeof (float) * n);
+			break;
 		}
 
-		n_remain -= n;
-		off += n;
-	}
-	return 0;
-}
+		struct timeval tv = { 2, 0 };
+		setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
 
-static uint32_t
-trim_end (uint32_t n_channels, uint32_t rate, uint32_t n_samples, float** data)
-{
-	float    sig_lvl = exp10f (.05 * -20);
-	float    sig_min = exp10f (.05 * -60);
-	uint32_t tme_min = rate / 20;
-
-	assert (n_samples > tme_min);
-
-	uint32_t tme_trim = n_samples;
-	uint32_t t        = 0;
-	bool     init     = true;
-
-	for (uint32_t n = 0; n < n_samples; ++n) {
-		bool silent = !init;
-		for (uint32_t c = 0; c < n_channels; ++c) {
-			float s = fabsf (data[c][n]);
-			if (s > sig_lvl) {
-				init = false;
-			}
-			if (s > sig_min) {
-				silent = false;
+		char   line[4096];
+		size_t len = 0;
+		while (len < sizeof (line) - 1) {
+			ssize_t rv = read (fd, &line[len], sizeof (line) - 1 - len);
+			if (rv <= 0) {
+				break;
 			}
-		}
-		if (silent) {
-			if (++t > tme_min) {
-				tme_trim = n;
+			len += rv;
+			if (memchr (line, '\n', len)) {
 				break;
 			}
-		} else {
-			t = 0;
 		}
-	}
-
-	assert (tme_trim >= tme_min);
-
-	/* fade-out tail */
-	uint32_t off = tme_trim - tme_min;
-	for (uint32_t n = 0; n < tme_min; ++n) {
-		float g = 1.f - (n / (float)tme_min);
-		for (uint32_t c = 0; c < n_channels; ++c) {
-			data[c][off + n] *= g;
+		line[len] = '\0';
+
+		CaptureJob* job  = new CaptureJob ();
+		job->fd          = fd;
+		job->id          = ++job_id;
+		job->true_stereo = false;
+		job->overwrite   = false;
+		job->latency     = 0;
+
+		const char* err = job_parse (line, job);
+		if (err) {
+			job_done (job, err, NULL, 0);
+			continue;
 		}
-	}
-
-	for (uint32_t c = 0; c < n_channels; ++c) {
-		memset (&data[c][tme_trim], 0, sizeof (float) * (n_samples - tme_trim));
-	}
-
-	return tme_trim;
-}
 
-static float
-digital_peak (uint32_t n_channels, uint32_t n_samples, float** data)
-{
-	float sig_max = 0;
-	for (uint32_t c = 0; c < n_channels; ++c) {
-		for (uint32_t n = 0; n < n_samples; ++n) {
-			float s = fabsf (data[c][n]);
-			if (s > sig_max) {
-				sig_max = s;
-			}
-		}
+		pthread_mutex_lock (&job_lock);
+		job_queue.push_back (job);
+		pthread_cond_signal (&job_cond);
+		pthread_mutex_unlock (&job_lock);
 	}
-	return sig_max;
+	return NULL;
 }
 
-static float
-normalize_peak (uint32_t n_channels, uint32_t n_samples, float** data)
+/* capture a job, post-processing and the reply are left to the session */
+static void
+run_job (IrCapture& session, CaptureJob* job, bool quiet)
 {
-	float sig_max = digital_peak (n_channels, n_samples, data);
-	float target  = exp10f (.05 * -3);
+	const char* err = NULL;
 
-	if (sig_max == 0 || sig_max > target) {
-		return 1.0;
+	if (file_exists (job->outfile) && !job->overwrite) {
+		err = "IR file exists";
+	} else if (session.connect (job->capt, job->play, job->true_stereo)) {
+		err = "Cannot connect ports";
 	}
 
-	const float g = target / sig_max;
-	for (uint32_t c = 0; c < n_channels; ++c) {
-		for (uint32_t n = 0; n < n_samples; ++n) {
-			data[c][n] *= g;
+	if (!err) {
+		if (!quiet) {
+			printf ("Job %u: capturing '%s'\n", job->id, job->outfile.c_str ());
+		}
+		if (session.capture (job->outfile, job->rawfile, job->latency, job) < 0) {
+			err = "Capture failed";
 		}
 	}
-	return g;
+
+	session.disconnect ();
+
+	if (err) {
+		job_done (job, err, NULL, session.rate ());
+	}
 }
 
-static uint32_t
-gensweep (float fmin, float fmax, float t_sec, float rate)
+static int
+run_daemon (IrCapture& session, const char* path, bool quiet)
 {
-	int n_samples_pre = rate * 0.1f;
-	int n_samples_sin = rate * t_sec;
-	int n_samples_end = rate * 0.03f;
+	struct sockaddr_un addr;
+	pthread_t          thread;
 
-	int n_samples = n_samples_pre + n_samples_sin + n_samples_end;
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		fprintf (stderr, "Socket path is too long\n");
+		return -1;
+	}
 
-	free (sweep_sin);
-	free (sweep_inv);
-	sweep_sin = (float*)malloc (sizeof (float) * n_samples);
-	sweep_inv = (float*)malloc (sizeof (float) * n_samples);
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
 
-	double amp = 0.5;
+	daemon_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (daemon_fd < 0) {
+		fprintf (stderr, "Cannot create socket\n");
+		return -1;
+	}
 
-	double a = log (fmax / fmin) / (double)n_samples_sin;
-	double b = fmin / (a * rate);
-	double r = 4.0 * a * a / amp;
+	unlink (path);
+	if (bind (daemon_fd, (struct sockaddr*)&addr, sizeof (addr)) || listen (daemon_fd, 16)) {
+		fprintf (stderr, "Cannot listen on '%s': %s\n", path, strerror (errno));
+		close (daemon_fd);
+		return -1;
+	}
 
-	for (int i = 0; i < n_samples; ++i) {
-		int j = n_samples - i - 1;
+	daemon_run = true;
+	if (pthread_create (&thread, NULL, daemon_listen, NULL)) {
+		fprintf (stderr, "Cannot start socket listener\n");
+		close (daemon_fd);
+		unlink (path);
+		return -1;
+	}
 
-		double gain = 1.0;
-		if (i < n_samples_pre) {
-			gain = sin (0.5 * M_PI * i / n_samples_pre);
-		} else if (j < n_samples_end) {
-			gain = sin (0.5 * M_PI * j / n_samples_end);
-		}
+	if (!quiet) {
+		printf ("Waiting for capture jobs on '%s'\n", path);
+	}
 
-		double d = b * exp (a * (i - n_samples_pre));
-		double p = d - b;
-		double x = gain * sin (2.f * M_PI * (p - floor (p)));
+	while (daemon_run) {
+		pthread_mutex_lock (&job_lock);
+		if (job_queue.empty ()) {
+			struct timespec ts;
+			clock_gettime (CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait (&job_cond, &job_lock, &ts);
+		}
+		CaptureJob* job = NULL;
+		if (!job_queue.empty () && daemon_run) {
+			job = job_queue.front ();
+			job_queue.pop_front ();
+		}
+		pthread_mutex_unlock (&job_lock);
 
-		sweep_sin[i] = x * amp;
-		sweep_inv[j] = x * d * r;
+		if (job) {
+			run_job (session, job, quiet);
+		}
 	}
-	return n_samples;
-}
 
-static void
-cleanup ()
-{
-	free (input_ports);
-	free (output_ports);
-	free (sweep_sin);
-	free (sweep_inv);
+	session.finish ();
+
+	shutdown (daemon_fd, SHUT_RDWR);
+	pthread_join (thread, NULL);
+	close (daemon_fd);
+	unlink (path);
 
-	for (uint32_t n = 0; ir && n < n_ir; ++n) {
-		free (ir[n]);
+	while (!job_queue.empty ()) {
+		CaptureJob* job = job_queue.front ();
+		job_queue.pop_front ();
+		job_done (job, "Daemon is shutting down", NULL, session.rate ());
 	}
-	free (ir);
+	return 0;
 }
 
 static void
 catchsig (int sig)
 {
 	fprintf (stderr, "caught signal - shutting down.\n");
-	client_state = Abort;
-}
-
-static bool
-file_exists (std::string const& name)
-{
-	struct stat buffer;
-	return (stat (name.c_str (), &buffer) == 0);
+	daemon_run = false;
+	if (capture_session) {
+		capture_session->interrupt ();
+	}
 }
 
 static void
@@ -495,24 +539,83 @@ print_usage (void)
 	printf ("\n"
 	        "Options:\n"
 	        " -h, --help                Display this help and exit\n"
+	        " -A, --adaptive            End the capture once the response decayed into\n"
+	        "                           the noise floor (-C is the upper bound)\n"
+	        " -a, --auto-gain <dB>      Probe the loop gain first and set the sweep level\n"
+	        "                           to leave the given headroom (e.g. 6)\n"
 	        " -c, --capture <port>      Add channel, specify source-port to connect to\n"
 	        " -C <sec>                  Max capture length (default 15s)\n"
+	        " -D, --daemon <socket>     Keep running and accept capture jobs on the\n"
+	        "                           given unix-socket (see below)\n"
+	        " -F, --freewheel           Run JACK in freewheel mode during the capture,\n"
+	        "                           for software signal-chains only\n"
+	        " -G, --group               Start another port group (device under test),\n"
+	        "                           the following -c and -p options apply to it\n"
 	        " -p, --playback <port>     Add playback-port to connect to\n"
+	        " -P, --programs <list>     Capture a batch, sending each MIDI program\n"
+	        "                           (e.g. 0-7,12) before the capture. Values above\n"
+	        "                           127 also send bank-select (value / 128)\n"
 	        " -j, --jack-name <name>    Set the JACK client name\n"
+	        " -k, --midi-channel <chn>  MIDI channel for program changes (default: 1)\n"
 	        " -L, --latency <int>       Specify custom round-trip latency (audio-samples)\n"
+	        " -l, --live                Continuously capture periodic MLS and publish\n"
+	        "                           each IR to OUT-FILE (shared memory map)\n"
+	        " -m, --midi-connect <port>\n"
+	        "                           Connect the MIDI output to the given port\n"
+	        " -M, --mls <order>         Use a maximum length sequence of length\n"
+	        "                           2^order - 1 instead of a sine-sweep (10..20)\n"
+	        " -N, --periods <num>       Number of MLS periods to average (default: 4)\n"
+	        " -s, --simulate <spec>     Capture from a simulated device instead of JACK,\n"
+	        "                           faster than realtime (see below)\n"
 	        " -S <sec>                  Silence between true-stereo captures (default: 1s)\n"
 	        " -T, --true-stereo         4 channel, true stereo IR. This needs 2 capture,\n"
 	        "                           and 2 playback channels.\n"
 	        " -q, --quiet               Inhibit non-error messages\n"
+	        " -r, --report <file>       Append a JSON line with timing and quality of\n"
+	        "                           each capture to the file, or 'fd:<num>'\n"
+	        " -R, --raw <file>          Also save the raw capture (before deconvolution)\n"
 	        " -V, --version             Print version information and exit\n"
+	        " -W, --settle <sec>        Wait after a program-change (default: 2s)\n"
 	        " -y, --overwrite           Replace output file if it exists\n"
-	        "If the OUT-FILE parameter is not given, 'ir.wav' is used.\n");
+	        "If the OUT-FILE parameter is not given, 'ir.wav' is used.\n"
+	        "With a program list the number is appended, e.g. 'ir-012.wav'.\n"
+	        "\n"
+	        "Port groups are captured concurrently with the same sine-sweep, and\n"
+	        "one IR file is written per group, e.g. 'ir-g01.wav', 'ir-g02.wav'.\n"
+	        "Each group has its own 1-2 capture and playback ports. A group that\n"
+	        "clips does not affect the others. Port groups cannot be combined with\n"
+	        "true-stereo, MLS, auto-gain, adaptive, live or daemon mode.\n"
+	        "\n"
+	        "In live mode a periodic MLS (order 14 unless -M is given) is played\n"
+	        "continuously. The latest IR and its magnitude response are published to\n"
+	        "OUT-FILE, a memory-mapped file with a small header, until interrupted.\n"
+	        "\n"
+	        "The report includes wall and CPU time of each stage, input peak, gain,\n"
+	        "estimated SNR and noise floor, the latency used, reported and measured,\n"
+	        "and the IR length.\n"
+	        "\n"
+	        "In daemon mode each connection to the socket submits one job as a single\n"
+	        "line of key=value tokens: capture=<port> (1-2x), playback=<port> (1-2x),\n"
+	        "out=<file>, and optionally true-stereo=1, overwrite=1, latency=<spl>,\n"
+	        "raw=<file>.\n"
+	        "Jobs are queued and the result is sent back as a JSON line once the IR\n"
+	        "has been written.\n"
+	        "\n"
+	        "The simulation routes the sweep through a known IR, and reports the\n"
+	        "accuracy of the result. <spec> is 'default' or a comma separated list of\n"
+	        "rate=<Hz>, period=<spl>, delay=<spl>, gain=<dB>, noise=<dBFS>,\n"
+	        "drive=<tanh gain>, rt60=<sec> (synthetic IR) or ir=<file>.\n"
+	        "With max-error=<dB> and/or max-align=<spl> the capture fails if an IR\n"
+	        "deviates more, see 'make check'.\n"
+	        "Port names are optional, their count sets the channels.\n");
 
 	printf ("\n"
 	        "Examples:\n"
 	        "jack-ir -c system:capture_1 -p system:playback_1\n\n"
 	        "jack-ir -c system:capture_1 -c system:capture_2 -p system:playback_1 mono_to_stereo.wav\n\n"
-	        "jack-ir -T -c system:capture_3 -c system:capture_4 -p system:playback_5 -p system:playback_6\n\n");
+	        "jack-ir -T -c system:capture_3 -c system:capture_4 -p system:playback_5 -p system:playback_6\n\n"
+	        "jack-ir -c system:capture_1 -p system:playback_1 -G -c system:capture_2 -p system:playback_2\n\n"
+	        "jack-ir -s noise=-80,drive=2 -y /tmp/sim.wav\n\n");
 
 	printf ("Report bugs at <https://github.com/x42/jack-ir/issues>\n");
 	printf ("Website: <http://github.com/x42/jack-ir>\n");
@@ -531,50 +634,98 @@ print_version (void)
 int
 main (int argc, char** argv)
 {
-	int            rv          = -1;
-	uint32_t       n_max       = 0;
-	const char*    client_name = "ir";
-	int            latency     = 0;
-	bool           overwrite   = false;
-	bool           quiet       = false;
-	bool           xrun_abort  = true;
-	jack_options_t options     = JackNoStartServer;
-	jack_status_t  status;
+	int         rv          = -1;
+	const char* client_name = "ir";
+	int         latency     = 0;
+	bool        overwrite   = false;
+	bool        quiet       = false;
+	bool        adaptive    = false;
+	bool        freewheel   = false;
+	bool        true_stereo = false;
+	bool        live_mode   = false;
+	uint32_t    mls_order   = 0;
+	uint32_t    mls_periods = 4;
+	IrConfig    cfg;
+	IrCapture   session;
 
 	float sweep_min = 20.f;    // Hz
 	float sweep_max = 20000.f; // Hz
 	float sweep_sec = 10.f;    // sec (without fades)
 	float irrec_sec = 15.f;    // sec
 	float t_silence = 1.f;     // sec
+	float sweep_amp = .5f;
+	float headroom  = -1;      // dB, < 0: no auto-gain
 
 	std::string outfile = "ir.wav";
+	std::string rawfile;
+	std::string report;
+	std::string sim;
+	std::string daemon_path;
+	std::string midi_connect;
+
+	std::vector<int> programs;
+	int              midi_chn  = 0;
+	bool             midi_bank = false;
+	float            settle    = 2.f; // sec
 
 	std::vector<std::string> capt;
 	std::vector<std::string> play;
+	std::vector<IrPortGroup> groups; /* additional devices */
 
 	/* clang-format off */
 	const struct option long_options[] = {
+		{ "adaptive",  no_argument,       0, 'A' },
+		{ "auto-gain", required_argument, 0, 'a' },
 		{ "capture",   required_argument, 0, 'c' },
+		{ "daemon",    required_argument, 0, 'D' },
+		{ "freewheel", no_argument,       0, 'F' },
+		{ "group",     no_argument,       0, 'G' },
 		{ "help",      no_argument,       0, 'h' },
 		{ "jack-name", required_argument, 0, 'j' },
 		{ "latency",   required_argument, 0, 'L' },
+		{ "live",      no_argument,       0, 'l' },
 		{ "playback",  required_argument, 0, 'p' },
+		{ "programs",  required_argument, 0, 'P' },
+		{ "settle",    required_argument, 0, 'W' },
 		{ "quiet",     no_argument,       0, 'q' },
+		{ "raw",       required_argument, 0, 'R' },
+		{ "report",    required_argument, 0, 'r' },
+		{ "simulate",  required_argument, 0, 's' },
 		{ "version",   no_argument,       0, 'V' },
 		{ "overwrite", no_argument,       0, 'y' },
+		{ "midi-channel", required_argument, 0, 'k' },
+		{ "midi-connect", required_argument, 0, 'm' },
+		{ "mls",       required_argument, 0, 'M' },
+		{ "periods",   required_argument, 0, 'N' },
+		{ 0, 0, 0, 0 }
 	};
 	/* clang-format on */
 
-	const char* optstring = "C:c:hj:L:p:S:TqVy";
+	const char* optstring = "Aa:C:c:D:FGhj:k:L:lM:m:N:P:p:R:r:S:s:TqVW:y";
 
 	int c;
 	while ((c = getopt_long (argc, argv, optstring, long_options, NULL)) != -1) {
 		switch (c) {
+			case 'A':
+				adaptive = true;
+				break;
+			case 'a':
+				headroom = std::min (40.f, std::max (1.f, (float)atof (optarg)));
+				break;
 			case 'C':
 				irrec_sec = atof (optarg);
 				break;
 			case 'c':
-				capt.push_back (optarg);
+				(groups.empty () ? capt : groups.back ().capture).push_back (optarg);
+				break;
+			case 'D':
+				daemon_path = optarg;
+				break;
+			case 'F':
+				freewheel = true;
+				break;
+			case 'G':
+				groups.push_back (IrPortGroup ());
 				break;
 			case 'h':
 				print_usage ();
@@ -583,11 +734,41 @@ main (int argc, char** argv)
 			case 'j':
 				client_name = optarg;
 				break;
+			case 'k':
+				midi_chn = std::min (16, std::max (1, atoi (optarg))) - 1;
+				break;
 			case 'L':
 				latency = atoi (optarg);
 				break;
+			case 'l':
+				live_mode = true;
+				break;
+			case 'M':
+				mls_order = atoi (optarg);
+				break;
+			case 'm':
+				midi_connect = optarg;
+				break;
+			case 'N':
+				mls_periods = std::min (64, std::max (1, atoi (optarg)));
+				break;
+			case 'P':
+				if (!parse_programs (optarg, programs)) {
+					fprintf (stderr, "Invalid program list '%s'\n", optarg);
+					return 1;
+				}
+				break;
 			case 'p':
-				play.push_back (optarg);
+				(groups.empty () ? play : groups.back ().playback).push_back (optarg);
+				break;
+			case 'R':
+				rawfile = optarg;
+				break;
+			case 'r':
+				report = optarg;
+				break;
+			case 's':
+				sim = optarg;
 				break;
 			case 'S':
 				t_silence = std::min (10.f, std::max (1.f, (float)atof (optarg)));
@@ -602,6 +783,9 @@ main (int argc, char** argv)
 				print_version ();
 				return 0;
 				break;
+			case 'W':
+				settle = std::min (60.f, std::max (0.f, (float)atof (optarg)));
+				break;
 			case 'y':
 				overwrite = true;
 				break;
@@ -623,235 +807,269 @@ main (int argc, char** argv)
 		outfile = argv[optind];
 	}
 
-	n_inputs  = capt.size ();
-	n_outputs = play.size ();
-
-	if (n_outputs < 1 || n_outputs > 2 || n_inputs < 1 || n_inputs > 2 || n_outputs > n_inputs) {
-		fprintf (stderr, "Invalid number of i/o ports\n");
-		return -1;
+	if (!daemon_path.empty ()) {
+		if (mls_order > 0 || live_mode || headroom >= 0 || true_stereo || !capt.empty () || !play.empty () || !groups.empty () || !programs.empty () || !rawfile.empty ()) {
+			fprintf (stderr, "Daemon mode only supports sine-sweep options, ports are given per job\n");
+			return -1;
+		}
+		/* register all ports, jobs use a subset */
+		capt.resize (2);
+		play.resize (2);
 	}
 
-	if (n_outputs != 2 || n_inputs != 2) {
-		if (true_stereo) {
-			fprintf (stderr, "True-Stereo needs stereo I/O\n");
+	const bool sim_mode = !sim.empty ();
+
+	if (sim_mode) {
+		if (!daemon_path.empty () || live_mode || !programs.empty ()) {
+			fprintf (stderr, "Simulation cannot be combined with daemon, live or program modes\n");
 			return -1;
 		}
+		if (capt.empty ()) {
+			capt.resize (true_stereo ? 2 : 1);
+		}
+		if (play.empty ()) {
+			play.resize (true_stereo ? 2 : 1);
+		}
+		for (size_t g = 0; g < groups.size (); ++g) {
+			if (groups[g].capture.empty ()) {
+				groups[g].capture.resize (1);
+			}
+			if (groups[g].playback.empty ()) {
+				groups[g].playback.resize (1);
+			}
+		}
 	}
 
-	if (irrec_sec < sweep_sec + .5f || irrec_sec > 30.f) {
-		fprintf (stderr, "Capture lenght is out of bounds %.1f < len <= 30.0 [sec]\n", sweep_sec + .5f);
+	if (play.size () < 1 || play.size () > 2 || capt.size () < 1 || capt.size () > 2 || play.size () > capt.size ()) {
+		fprintf (stderr, "Invalid number of i/o ports\n");
 		return -1;
 	}
 
-	if (file_exists (outfile)) {
-		if (!overwrite) {
-			fprintf (stderr, "Error: IR file exists ('%s')\n", outfile.c_str ());
+	for (size_t g = 0; g < groups.size (); ++g) {
+		const size_t n_in  = groups[g].capture.size ();
+		const size_t n_out = groups[g].playback.size ();
+		if (n_out < 1 || n_out > 2 || n_in < 1 || n_in > 2 || n_out > n_in) {
+			fprintf (stderr, "Invalid number of i/o ports in group %d\n", (int)g + 2);
 			return -1;
 		}
-		fprintf (stderr, "Warning: replacing IR ('%s')\n", outfile.c_str ());
 	}
 
-	if (true_stereo) {
-		assert (n_outputs == 2 && n_inputs == 2);
-		n_ir = 4;
-	} else {
-		n_ir = n_inputs;
+	if (play.size () != 2 || capt.size () != 2) {
+		if (true_stereo) {
+			fprintf (stderr, "True-Stereo needs stereo I/O\n");
+			return -1;
+		}
 	}
 
-	/* open a client connection to the JACK server */
-	jack_client_t* j_client = jack_client_open (client_name, options, &status, NULL);
-
-	if (!j_client) {
-		fprintf (stderr, "jack_client_open() failed (status 0x%x)\n", status);
-		if (status & JackServerFailed) {
-			fprintf (stderr, "Unable to connect to JACK server\n");
-		}
+	if (mls_order > 0 && (mls_order < 10 || mls_order > 20)) {
+		fprintf (stderr, "MLS order is out of bounds 10 <= order <= 20\n");
 		return -1;
 	}
 
-	jack_set_process_callback (j_client, jack_process, 0);
-	jack_set_graph_order_callback (j_client, jack_graph_order_cb, 0);
-	jack_on_shutdown (j_client, jack_shutdown, 0);
-	if (xrun_abort) {
-		jack_set_xrun_callback (j_client, jack_xrun, 0);
+	if (live_mode && mls_order == 0) {
+		mls_order = 14;
 	}
 
-	/* display the current sample rate. */
-	uint32_t rate = jack_get_sample_rate (j_client);
-	if (!quiet) {
-		printf ("Engine sample rate: %" PRIu32 "\n", rate);
+	if (mls_order > 0 && adaptive) {
+		fprintf (stderr, "Adaptive capture length is only available for sine-sweeps\n");
+		return -1;
 	}
-	if (rate < 44100 || rate > 96000) {
-		fprintf (stderr, "Invalid sample-rate, not (44100 <= rate <= 96000)\n");
-		goto out;
+
+	if (mls_order > 0 && headroom >= 0) {
+		fprintf (stderr, "Automatic gain is only available for sine-sweeps\n");
+		return -1;
 	}
 
-	if (true_stereo) {
-		true_stereo_pass = rate * t_silence;
+	if (mls_order > 0 && true_stereo) {
+		fprintf (stderr, "MLS excitation does not support True-Stereo\n");
+		return -1;
 	}
 
-	/* prepare sweep */
-	irrec_len = irrec_sec * rate;
-	sweep_len = gensweep (sweep_min, sweep_max, sweep_sec, rate);
+	if (irrec_sec < sweep_sec + .5f || irrec_sec > 30.f) {
+		fprintf (stderr, "Capture lenght is out of bounds %.1f < len <= 30.0 [sec]\n", sweep_sec + .5f);
+		return -1;
+	}
 
-#if 0 // Debug Dump sweep
-	{
-		float* sd[2] = { sweep_sin, sweep_inv };
-		sf_write ("/tmp/ir_sweep.wav", 2, rate, 0, sweep_len, sd);
+	if (!groups.empty () && (live_mode || mls_order > 0 || true_stereo || headroom >= 0 || adaptive)) {
+		fprintf (stderr, "Port groups are only supported with a plain sine-sweep\n");
+		return -1;
 	}
-#endif
 
-	ir           = (float**)calloc (n_ir, sizeof (float*));
-	input_ports  = (jack_port_t**)calloc (n_inputs, sizeof (jack_port_t*));
-	output_ports = (jack_port_t**)calloc (n_outputs, sizeof (jack_port_t*));
+	/* the list is not sorted, send bank-select with every program if any needs it */
+	midi_bank = !programs.empty () && *std::max_element (programs.begin (), programs.end ()) > 127;
 
-	if (!ir || !input_ports || !output_ports) {
-		fprintf (stderr, "Out of Memory\n");
-		goto out;
+	if (live_mode && !programs.empty ()) {
+		fprintf (stderr, "Live mode cannot be combined with a program list\n");
+		return -1;
 	}
 
-	for (uint32_t n = 0; n < n_outputs; ++n) {
-		char tmp[64];
-		snprintf (tmp, sizeof (tmp), "sweep_%d", n + 1);
-		output_ports[n] = jack_port_register (j_client, tmp,
-		                                      JACK_DEFAULT_AUDIO_TYPE,
-		                                      JackPortIsOutput, 0);
+	if (freewheel && (sim_mode || live_mode || !daemon_path.empty ())) {
+		fprintf (stderr, "Freewheel mode is only available for JACK captures\n");
+		return -1;
+	}
 
-		if (!output_ports[n]) {
-			fprintf (stderr, "No more JACK ports available\n");
-			goto out;
-		}
+	if (live_mode && !rawfile.empty ()) {
+		fprintf (stderr, "Live mode cannot save the raw capture\n");
+		return -1;
 	}
 
-	for (uint32_t n = 0; n < n_inputs; ++n) {
-		char tmp[64];
-		snprintf (tmp, sizeof (tmp), "input_%d", n + 1);
-		input_ports[n] = jack_port_register (j_client, tmp,
-		                                     JACK_DEFAULT_AUDIO_TYPE,
-		                                     JackPortIsInput, 0);
+	if (live_mode && !report.empty ()) {
+		fprintf (stderr, "Live mode does not produce a report\n");
+		return -1;
+	}
 
-		if (!input_ports[n]) {
-			fprintf (stderr, "No more JACK ports available\n");
-			goto out;
+	if (daemon_path.empty () && programs.empty ()) {
+		std::vector<std::string> fns = group_filenames (outfile, 1 + groups.size ());
+		for (size_t g = 0; g < fns.size (); ++g) {
+			if (!file_exists (fns[g])) {
+				continue;
+			}
+			if (!overwrite) {
+				fprintf (stderr, "Error: IR file exists ('%s')\n", fns[g].c_str ());
+				return -1;
+			}
+			fprintf (stderr, "Warning: replacing IR ('%s')\n", fns[g].c_str ());
 		}
 	}
 
-	for (uint32_t n = 0; n < n_ir; ++n) {
-		ir[n] = (float*)calloc (sweep_len + irrec_len, sizeof (float));
-		if (!ir[n]) {
-			fprintf (stderr, "Out of Memory\n");
-			goto out;
+	if (report.compare (0, 3, "fd:") == 0) {
+		report_fd = atoi (report.c_str () + 3);
+		if (report_fd < 0 || fcntl (report_fd, F_GETFD) < 0) {
+			fprintf (stderr, "Invalid report file descriptor '%s'\n", report.c_str () + 3);
+			return -1;
+		}
+	} else if (!report.empty ()) {
+		report_fd = open (report.c_str (), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (report_fd < 0) {
+			fprintf (stderr, "Cannot open report file '%s'\n", report.c_str ());
+			return -1;
 		}
+		report_own = true;
 	}
 
-#if 0 // DEBUG test convolv
-	for (uint32_t n = 0; n < n_ir; ++n) {
-		memcpy (ir[n], sweep_sin, sweep_len * sizeof (float));
+	cfg.client_name  = client_name;
+	cfg.sim          = sim;
+	cfg.capture      = capt;
+	cfg.playback     = play;
+	cfg.groups       = groups;
+	cfg.true_stereo  = true_stereo;
+	cfg.sweep_min    = sweep_min;
+	cfg.sweep_max    = sweep_max;
+	cfg.sweep_sec    = sweep_sec;
+	cfg.sweep_amp    = sweep_amp;
+	cfg.irrec_sec    = irrec_sec;
+	cfg.t_silence    = t_silence;
+	cfg.headroom     = headroom;
+	cfg.adaptive     = adaptive;
+	cfg.mls_order    = mls_order;
+	cfg.mls_periods  = mls_periods;
+	cfg.latency      = latency;
+	cfg.freewheel    = freewheel;
+	cfg.midi         = !programs.empty ();
+	cfg.midi_connect = midi_connect;
+	cfg.pipeline     = programs.size () > 1 || !daemon_path.empty ();
+	cfg.timing       = report_fd >= 0;
+	cfg.quiet        = quiet;
+
+	session.set_result_callback (capture_done, NULL);
+	if (!quiet) {
+		session.set_progress_callback (capture_progress, NULL);
 	}
-	if (convolv (n_ir, sweep_len + irrec_len, ir)) { goto out; }
-	rv = sf_write ("/tmp/ir_conv.wav", n_ir, rate, 0, sweep_len + irrec_len, ir);
-	goto out;
-#endif
 
-	if (jack_activate (j_client)) {
-		fprintf (stderr, "Cannot activate JACK client");
+	if (session.open (cfg)) {
 		goto out;
 	}
 
-	/* connect ports */
-	for (uint32_t n = 0; n < n_outputs; ++n) {
-		jack_connect (j_client, jack_port_name (output_ports[n]), play[n].c_str ());
-	}
-
-	for (uint32_t n = 0; n < n_inputs; ++n) {
-		jack_connect (j_client, capt[n].c_str (), jack_port_name (input_ports[n]));
+	/* display the current sample rate. */
+	if (!quiet) {
+		printf ("Engine sample rate: %" PRIu32 "\n", session.rate ());
 	}
 
-	n_max = irrec_len;
-	if (true_stereo) {
-		n_max += irrec_len + true_stereo_pass;
-	}
+	capture_session = &session;
 
 #ifndef _WIN32
 	signal (SIGHUP, catchsig);
 	signal (SIGINT, catchsig);
 #endif
 
-	sleep (1);
-	client_state = Run;
+	if (!daemon_path.empty ()) {
+		rv = run_daemon (session, daemon_path.c_str (), quiet);
+		goto out;
+	}
 
 	if (!quiet) {
 		if (latency > 0) {
-			printf ("JACK round-trip latency: %d (ignored, using %d)\n", roundtrip_latency, latency);
+			printf ("JACK round-trip latency: %d (ignored, using %d)\n", session.roundtrip_latency (), latency);
 		} else {
-			printf ("Round-trip latency: %d\n", roundtrip_latency);
+			printf ("Round-trip latency: %d\n", session.roundtrip_latency ());
 		}
 	}
 
-	while (client_state == Run) {
-		sleep (1);
-		if (!quiet) {
-			printf ("Processing: %3.0f%% (%c) \r",
-			        std::min (100.f, 100.f * proc_tot / n_max),
-			        proc_pos < sweep_len ? 'P' : 'C');
-			fflush (stdout);
-		}
-	}
-	if (!quiet) {
-		printf ("\n");
+	if (live_mode) {
+		rv = session.live (outfile);
+		goto out;
 	}
 
-	/* post-process, if capture was not aborted */
-	if (client_state == Exit) {
-		float in_peak = digital_peak (n_ir, sweep_len + irrec_len, ir);
+	rv = 0;
 
-		if (!quiet) {
-			printf ("Input signal peak: %.2fdBFS\n", 20 * log (in_peak));
-		}
+	for (size_t b = 0; b < std::max<size_t> (1, programs.size ()); ++b) {
+		std::string fn  = outfile;
+		std::string raw = rawfile;
 
-		if (in_peak >= .98) {
-			fprintf (stderr, "Input signal clipped!\n");
-			goto out;
+		if (!programs.empty ()) {
+			fn = program_filename (outfile, programs[b]);
+			if (!raw.empty ()) {
+				raw = program_filename (rawfile, programs[b]);
+			}
 		}
 
-		if (convolv (n_ir, sweep_len + irrec_len, ir)) {
-			fprintf (stderr, "Deconvolution failed\n");
-			goto out;
-		}
+		std::vector<std::string> fns = group_filenames (fn, session.n_groups ());
 
-		float g = normalize_peak (n_ir, sweep_len + irrec_len, ir);
-		if (!quiet) {
-			printf ("Normalized IR, gain-factor: %.2fdB\n", 20 * log (g));
+		if (!programs.empty ()) {
+			bool exists = false;
+			for (size_t g = 0; g < fns.size () && !overwrite; ++g) {
+				if (file_exists (fns[g])) {
+					fprintf (stderr, "Error: IR file exists ('%s')\n", fns[g].c_str ());
+					exists = true;
+				}
+			}
+			if (exists) {
+				rv = -1;
+				continue;
+			}
+			if (!quiet) {
+				printf ("Program %d: settling for %.1f sec\n", programs[b], settle);
+			}
+			if (session.send_program (programs[b], midi_chn, midi_bank, settle)) {
+				rv = -1;
+				break;
+			}
 		}
 
-		uint32_t trimed_len = trim_end (n_ir, rate, sweep_len + irrec_len, ir);
-
-		int lat = 0;
-		if (latency > 0) {
-			lat = latency;
+		int cr = session.capture_groups (fns, raw);
+		if (cr < 0) {
+			rv = -1;
+			break;
 		}
-#if 1 /* allow for some io-delay inaccuracy and sinc pre-ringing */
-		else if (roundtrip_latency > 3) {
-			lat = roundtrip_latency - 4;
-		}
-#endif
-		else {
-			lat = roundtrip_latency;
+		if (!quiet) {
+			printf ("\n");
 		}
 
-		if (trimed_len < sweep_len + lat) {
-			fprintf (stderr, "IR is too short or empty\n");
-		} else {
-			uint32_t ir_len = trimed_len - (sweep_len + lat);
-			if (!quiet) {
-				printf ("Writing IR: %d channels, %.1f [sec] = %d [spl] '%s'\n", n_ir, ir_len / (float)rate, ir_len, outfile.c_str ());
-			}
-			rv = sf_write (outfile.c_str (), n_ir, rate, sweep_len + lat, ir_len, ir);
+		/* continue the batch after clipping, stop if interrupted */
+		if (cr > 0) {
+			break;
 		}
 	}
 
+	if (!session.finish ()) {
+		rv = -1;
+	}
+
 out:
-	jack_client_close (j_client);
-	cleanup ();
+	capture_session = NULL;
+	session.close ();
+	if (report_own) {
+		close (report_fd);
+	}
 	return rv;
 }
@@ -0,0 +1,3669 @@
+/* libjackir - JACK Impulse Response Capture
+ *
+ * Copyright (C) 2019 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <sndfile.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "zita-convolver.h"
+
+#include "jackir.h"
+
+using namespace IrJackZitaConvolver;
+
+/* live monitoring, periodic MLS: the process callback fills one buffer
+ * while the worker deconvolves the other one.
+ */
+struct LiveHeader {
+	char     magic[8]; /* "jack-ir" */
+	uint32_t version;
+	uint32_t rate;
+	uint32_t n_channels;
+	uint32_t ir_len;  /* followed by n_channels * ir_len IR samples */
+	uint32_t n_bins;  /* followed by n_channels * n_bins magnitudes [dB] */
+	uint32_t seq;     /* odd while an update is in progress */
+	uint32_t n_updates;
+	uint32_t n_dropped;
+	float    peak;    /* input peak of the last period */
+	float    reserved;
+};
+
+/* LFSR feedback masks of primitive polynomials, by order */
+static const uint32_t mls_taps[21] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0x0009, /* x^10 + x^3 + 1 */
+	0x0005, /* x^11 + x^2 + 1 */
+	0x0053, /* x^12 + x^6 + x^4 + x + 1 */
+	0x001b, /* x^13 + x^4 + x^3 + x + 1 */
+	0x002b, /* x^14 + x^5 + x^3 + x + 1 */
+	0x0003, /* x^15 + x + 1 */
+	0x002d, /* x^16 + x^5 + x^3 + x^2 + 1 */
+	0x0009, /* x^17 + x^3 + 1 */
+	0x0081, /* x^18 + x^7 + 1 */
+	0x0027, /* x^19 + x^5 + x^2 + x + 1 */
+	0x0009, /* x^20 + x^3 + 1 */
+};
+
+const char* const stage_name[N_STAGES] = {
+	"setup", "settle", "probe", "capture", "deconvolution", "normalize", "trim", "write"
+};
+
+static double
+clock_sec (clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime (clk, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* stages may be timed repeatedly, and in different threads,
+ * as long as begin and end are called by the same thread */
+static void
+stage_begin (StageTime* t)
+{
+	t->wall -= clock_sec (CLOCK_MONOTONIC);
+	t->cpu -= clock_sec (CLOCK_THREAD_CPUTIME_ID);
+}
+
+static void
+stage_end (StageTime* t)
+{
+	t->wall += clock_sec (CLOCK_MONOTONIC);
+	t->cpu += clock_sec (CLOCK_THREAD_CPUTIME_ID);
+}
+
+typedef float    fv4 __attribute__ ((vector_size (16), aligned (4)));
+typedef uint32_t uv4 __attribute__ ((vector_size (16), aligned (4)));
+
+static float
+block_peak (const float* d, uint32_t n)
+{
+	fv4      m0 = { 0, 0, 0, 0 };
+	fv4      m1 = { 0, 0, 0, 0 };
+	uint32_t i  = 0;
+
+	const uv4 abs_mask = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+
+	for (; i + 8 <= n; i += 8) {
+		const fv4 a = (fv4)(*(const uv4*)&d[i] & abs_mask);
+		const fv4 b = (fv4)(*(const uv4*)&d[i + 4] & abs_mask);
+		m0          = a > m0 ? a : m0;
+		m1          = b > m1 ? b : m1;
+	}
+	m0 = m1 > m0 ? m1 : m0;
+
+	float pk = std::max (std::max (m0[0], m0[1]), std::max (m0[2], m0[3]));
+	for (; i < n; ++i) {
+		pk = std::max (pk, fabsf (d[i]));
+	}
+	return pk;
+}
+
+/* Output files are encoded to memory, then written in large page-aligned
+ * chunks to "<name>.part", which is renamed when complete. Downstream
+ * tools never see a partially written file.
+ */
+struct WriteBuf {
+	char*      data; /* page-aligned */
+	sf_count_t len;
+	sf_count_t pos;
+	sf_count_t size;
+};
+
+static const size_t write_align = 4096;
+static const size_t write_chunk = 1 << 20;
+
+static int
+wb_reserve (WriteBuf* wb, sf_count_t size)
+{
+	if (size <= wb->size) {
+		return 0;
+	}
+	size = (size + write_align - 1) & ~(sf_count_t)(write_align - 1);
+
+	void* data;
+	if (posix_memalign (&data, write_align, size)) {
+		return -1;
+	}
+	if (wb->data) {
+		memcpy (data, wb->data, wb->len);
+		free (wb->data);
+	}
+	wb->data = (char*)data;
+	wb->size = size;
+	return 0;
+}
+
+static sf_count_t
+vio_get_filelen (void* user)
+{
+	return ((WriteBuf*)user)->len;
+}
+
+static sf_count_t
+vio_seek (sf_count_t offset, int whence, void* user)
+{
+	WriteBuf* wb = (WriteBuf*)user;
+	switch (whence) {
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			offset += wb->pos;
+			break;
+		case SEEK_END:
+			offset += wb->len;
+			break;
+		default:
+			return -1;
+	}
+	if (offset < 0) {
+		return -1;
+	}
+	wb->pos = offset;
+	return offset;
+}
+
+static sf_count_t
+vio_read (void* ptr, sf_count_t count, void* user)
+{
+	WriteBuf* wb = (WriteBuf*)user;
+	count        = std::max<sf_count_t> (0, std::min (count, wb->len - wb->pos));
+	memcpy (ptr, wb->data + wb->pos, count);
+	wb->pos += count;
+	return count;
+}
+
+static sf_count_t
+vio_write (const void* ptr, sf_count_t count, void* user)
+{
+	WriteBuf* wb = (WriteBuf*)user;
+	if (wb->pos + count > wb->size && wb_reserve (wb, std::max (wb->pos + count, 2 * wb->size))) {
+		return 0;
+	}
+	if (wb->pos > wb->len) {
+		memset (wb->data + wb->len, 0, wb->pos - wb->len);
+	}
+	memcpy (wb->data + wb->pos, ptr, count);
+	wb->pos += count;
+	wb->len = std::max (wb->len, wb->pos);
+	return count;
+}
+
+static sf_count_t
+vio_tell (void* user)
+{
+	return ((WriteBuf*)user)->pos;
+}
+
+/* a raw capture of all port groups, 2 inputs each */
+static const uint32_t max_channels = 64;
+
+static int
+sf_encode (WriteBuf* wb, uint32_t n_channels, uint32_t rate, uint32_t off_start, uint32_t n_frames, float** data)
+{
+	SNDFILE*      file;
+	SF_INFO       sfinfo;
+	SF_VIRTUAL_IO vio = { vio_get_filelen, vio_seek, vio_read, vio_write, vio_tell };
+
+	memset (&sfinfo, 0, sizeof (sfinfo));
+
+	if (n_channels < 1 || n_channels > max_channels) {
+		return -1;
+	}
+
+	/* header and peak-chunk fit in the first page */
+	wb->len = wb->pos = 0;
+	if (wb_reserve (wb, (sf_count_t)n_frames * n_channels * sizeof (float) + 2 * write_align)) {
+		return -1;
+	}
+
+	sfinfo.samplerate = rate;
+	sfinfo.frames     = n_frames;
+	sfinfo.channels   = n_channels;
+	sfinfo.format     = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+
+	if (!(file = sf_open_virtual (&vio, SFM_WRITE, &sfinfo, wb))) {
+		fprintf (stderr, "Error: Not able to encode output file.\n");
+		return -1;
+	}
+
+	float          buf[256 * 4];
+	const uint32_t chunk = (sizeof (buf) / sizeof (float)) / n_channels;
+	for (uint32_t f = 0; f < n_frames; f += chunk) {
+		uint32_t n = std::min<uint32_t> (chunk, n_frames - f);
+		for (uint32_t i = 0; i < n; ++i) {
+			for (uint32_t c = 0; c < n_channels; ++c) {
+				buf[i * n_channels + c] = data[c][off_start + f + i];
+			}
+		}
+		if (n != sf_writef_float (file, buf, n)) {
+			fprintf (stderr, "Error encoding file: %s\n", sf_strerror (file));
+			sf_close (file);
+			return -2;
+		}
+	}
+
+	sf_close (file);
+	return 0;
+}
+
+#ifdef HAVE_LIBURING
+static struct io_uring write_ring;
+static bool            write_ring_ok = false;
+#endif
+
+static int
+write_data (int fd, const char* data, size_t len)
+{
+	size_t off = 0;
+#ifdef HAVE_LIBURING
+	while (write_ring_ok && off < len) {
+		unsigned n   = 0;
+		size_t   end = off;
+		for (; n < 8 && end < len; ++n) {
+			size_t               cnt = std::min (write_chunk, len - end);
+			struct io_uring_sqe* sqe = io_uring_get_sqe (&write_ring);
+			io_uring_prep_write (sqe, fd, data + end, cnt, end);
+			io_uring_sqe_set_data (sqe, (void*)(uintptr_t)cnt);
+			end += cnt;
+		}
+		io_uring_submit (&write_ring);
+
+		int err = 0;
+		for (unsigned i = 0; i < n; ++i) {
+			struct io_uring_cqe* cqe;
+			int                  rv = io_uring_wait_cqe (&write_ring, &cqe);
+			if (rv < 0) {
+				errno = -rv;
+				return -1;
+			}
+			if (cqe->res < 0) {
+				err = -cqe->res;
+			} else if ((uintptr_t)cqe->res != (uintptr_t)io_uring_cqe_get_data (cqe)) {
+				err = EIO;
+			}
+			io_uring_cqe_seen (&write_ring, cqe);
+		}
+		if (err) {
+			errno = err;
+			return -1;
+		}
+		off = end;
+	}
+#endif
+	while (off < len) {
+		ssize_t rv = pwrite (fd, data + off, std::min (write_chunk, len - off), off);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return -1;
+		}
+		off += rv;
+	}
+	return 0;
+}
+
+/* O_DIRECT is used where the filesystem supports it, the buffer
+ * is zero-padded to the alignment and truncated afterwards.
+ */
+static int
+write_file (const char* fn, WriteBuf* wb)
+{
+	std::string tmp = std::string (fn) + ".part";
+	size_t      len = (wb->len + write_align - 1) & ~(write_align - 1);
+
+	if (wb_reserve (wb, len)) {
+		return -1;
+	}
+	memset (wb->data + wb->len, 0, len - wb->len);
+
+	int fd = open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (fd < 0 && errno == EINVAL) {
+		fd = open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd < 0) {
+		fprintf (stderr, "Error: Not able to open output file '%s'.\n", tmp.c_str ());
+		return -1;
+	}
+
+	int rv = write_data (fd, wb->data, len);
+	if (rv && errno == EINVAL) {
+		/* O_DIRECT was accepted by open(), but not by write() */
+		rv = fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_DIRECT) || write_data (fd, wb->data, wb->len);
+	}
+	if (!rv && (sf_count_t)len != wb->len) {
+		rv = ftruncate (fd, wb->len);
+	}
+	if (!rv) {
+		rv = fdatasync (fd);
+	}
+	if (close (fd)) {
+		rv = -1;
+	}
+	if (!rv) {
+		rv = rename (tmp.c_str (), fn);
+	}
+	if (rv) {
+		fprintf (stderr, "Error writing file '%s': %s\n", fn, strerror (errno));
+		unlink (tmp.c_str ());
+		return -2;
+	}
+	return 0;
+}
+
+static int
+sf_write (const char* fn, uint32_t n_channels, uint32_t rate, uint32_t off_start, uint32_t n_frames, float** data)
+{
+	WriteBuf wb;
+	memset (&wb, 0, sizeof (wb));
+
+	int rv = sf_encode (&wb, n_channels, rate, off_start, n_frames, data);
+	if (!rv) {
+		rv = write_file (fn, &wb);
+	}
+	free (wb.data);
+	return rv;
+}
+
+/* Deconvolution engine, configured once for a given inverse sweep and
+ * channel-count and reused for subsequent captures. Apart from the
+ * FFT work, a capture only costs a reset of the convolver's state;
+ * no memory is allocated after configure().
+ */
+class Deconvolver
+{
+public:
+	Deconvolver ()
+		: _inv_gen (0)
+		, _inv_len (0)
+		, _n_channels (0)
+		, _dirty (false)
+	{
+	}
+
+	int  configure (uint32_t n_channels, float* inv, uint32_t inv_len, uint32_t inv_gen);
+	int  reset ();
+	int  process (uint32_t n_samples, float** data, uint32_t start = 0);
+	void cleanup ();
+
+private:
+	Convproc _p;
+	uint32_t _inv_gen; /* generation of the inverse sweep */
+	uint32_t _inv_len;
+	uint32_t _n_channels;
+	bool     _dirty;
+};
+
+/* The partitioned inverse is kept while its generation is unchanged,
+ * a regenerated sweep may well re-use the same address */
+int
+Deconvolver::configure (uint32_t n_channels, float* inv, uint32_t inv_len, uint32_t inv_gen)
+{
+	if (_p.state () != Convproc::ST_IDLE && n_channels == _n_channels && inv_gen == _inv_gen && inv_len == _inv_len) {
+		return reset ();
+	}
+
+	cleanup ();
+
+	/* all channels share the inverse sweep, use SIMD batched MAC */
+	_p.set_options (Convproc::OPT_VECTOR_MODE);
+
+	/* a single level, processed inline by process (): no level threads
+	 * are started, so there is nothing to hand to a Convpool */
+	int rv = _p.configure (
+	    /* in */ n_channels,
+	    /* out */ n_channels,
+	    /* max-convolution length */ inv_len,
+	    /* quantum, nominal-buffersize */ Convproc::MAXPART,
+	    /* Convproc::MINPART */ Convproc::MAXPART,
+	    /* Convproc::MAXPART */ Convproc::MAXPART,
+	    /* density */ 0);
+
+	if (rv != 0) {
+		return rv;
+	}
+
+	uint32_t io = 0;
+
+	rv = _p.impdata_load (
+	    /*channels */ 1,
+	    /*i/o map */ &io, &io,
+	    inv,
+	    0, inv_len,
+	    /*threads, one per CPU */ 0);
+
+	if (rv != 0) {
+		return rv;
+	}
+
+	for (uint32_t c = 1; c < n_channels; ++c) {
+		if (_p.impdata_link (0, 0, c, c)) {
+			cleanup ();
+			return -1;
+		}
+	}
+
+	if (_p.start_process (0, 0)) {
+		cleanup ();
+		return -1;
+	}
+
+	_inv_gen    = inv_gen;
+	_inv_len    = inv_len;
+	_n_channels = n_channels;
+	_dirty      = false;
+	return 0;
+}
+
+/* clear the convolver's history, retaining the inverse sweep */
+int
+Deconvolver::reset ()
+{
+	if (!_dirty) {
+		return 0;
+	}
+	if (_p.state () == Convproc::ST_PROC) {
+		_p.stop_process ();
+	}
+	while (!_p.check_stop ()) {
+		usleep (1000);
+	}
+	if (_p.start_process (0, 0)) {
+		return -1;
+	}
+	_dirty = false;
+	return 0;
+}
+
+/* Deconvolve data in-place. Only output samples [start, n_samples)
+ * are computed, the result in [0, start) is undefined. Input after
+ * n_samples does not affect the window, and is not processed.
+ */
+int
+Deconvolver::process (uint32_t n_samples, float** data, uint32_t start)
+{
+	if (reset () || _p.state () != Convproc::ST_PROC) {
+		return -1;
+	}
+
+	_dirty = true;
+
+	/* input spectra are still collected for the skipped part,
+	 * but no multiply-accumulate or inverse FFT is done */
+	_p.set_skipcnt (start);
+
+	uint32_t off      = 0;
+	uint32_t n_remain = n_samples;
+
+	while (n_remain > 0) {
+		uint32_t n = std::min (n_remain, (uint32_t)Convproc::MAXPART);
+
+		for (uint32_t c = 0; c < _n_channels; ++c) {
+			float* const in = _p.inpdata (c);
+			if (n < Convproc::MAXPART) {
+				memset (in, 0, sizeof (float) * Convproc::MAXPART);
+			}
+			memcpy (in, &data[c][off], sizeof (float) * n);
+		}
+
+		_p.process ();
+
+		for (uint32_t c = 0; off + n > start && c < _n_channels; ++c) {
+			float const* const out = _p.outdata (c);
+			memcpy (&data[c][off], out, sizeof (float) * n);
+		}
+
+		n_remain -= n;
+		off += n;
+	}
+	return 0;
+}
+
+void
+Deconvolver::cleanup ()
+{
+	_p.stop_process ();
+	_p.cleanup ();
+	_inv_gen    = 0;
+	_inv_len    = 0;
+	_n_channels = 0;
+	_dirty      = false;
+}
+
+/* Simulated device: the sweep is routed through a known IR with gain,
+ * delay, a tanh nonlinearity and white noise, at full CPU speed.
+ * Input n is fed by output n (or the last output).
+ */
+struct SimParams {
+	uint32_t    rate;
+	uint32_t    period;
+	uint32_t    delay; /* in addition to one period */
+	float       gain;  /* dB */
+	float       noise; /* dBFS RMS, <= -150: off */
+	float       drive; /* 0: linear */
+	float       rt60;  /* synthetic IR */
+	std::string ir_file;
+	float       max_error; /* dB, < 0: fail above */
+	int         max_align; /* samples, >= 0: fail above */
+};
+
+/* parse "key=value,..." tokens: rate, period, delay, gain, noise, drive, rt60, ir,
+ * and the pass/fail thresholds max-error, max-align */
+static bool
+sim_parse (SimParams& sim, const char* spec)
+{
+	char* tmp  = strdup (spec);
+	char* save = NULL;
+	bool  ok   = true;
+
+	for (char* tok = strtok_r (tmp, ",", &save); tok && ok; tok = strtok_r (NULL, ",", &save)) {
+		char* val = strchr (tok, '=');
+		if (!strcmp (tok, "default")) {
+			continue;
+		}
+		if (!val) {
+			ok = false;
+			break;
+		}
+		*val++ = '\0';
+		if (!strcmp (tok, "rate")) {
+			sim.rate = atoi (val);
+		} else if (!strcmp (tok, "period")) {
+			sim.period = atoi (val);
+		} else if (!strcmp (tok, "delay")) {
+			sim.delay = std::max (0, atoi (val));
+		} else if (!strcmp (tok, "gain")) {
+			sim.gain = atof (val);
+		} else if (!strcmp (tok, "noise")) {
+			sim.noise = atof (val);
+		} else if (!strcmp (tok, "drive")) {
+			sim.drive = std::max (0.f, (float)atof (val));
+		} else if (!strcmp (tok, "rt60")) {
+			sim.rt60 = std::min (10.f, std::max (0.f, (float)atof (val)));
+		} else if (!strcmp (tok, "ir")) {
+			sim.ir_file = val;
+		} else if (!strcmp (tok, "max-error")) {
+			sim.max_error = atof (val);
+		} else if (!strcmp (tok, "max-align")) {
+			sim.max_align = atoi (val);
+		} else {
+			ok = false;
+		}
+	}
+	free (tmp);
+
+	/* the period is the convolver's quantum */
+	if (sim.period < Convproc::MINPART || sim.period > Convproc::MAXPART || (sim.period & (sim.period - 1))) {
+		return false;
+	}
+	return ok;
+}
+
+static uint32_t
+trim_end (uint32_t n_channels, uint32_t rate, uint32_t n_samples, float** data)
+{
+	float    sig_lvl = exp10f (.05 * -20);
+	float    sig_min = exp10f (.05 * -60);
+	uint32_t tme_min = rate / 20;
+
+	assert (n_samples > tme_min);
+
+	uint32_t tme_trim = n_samples;
+	uint32_t t        = 0;
+	bool     init     = true;
+
+	for (uint32_t n = 0; n < n_samples; ++n) {
+		bool silent = !init;
+		for (uint32_t c = 0; c < n_channels; ++c) {
+			float s = fabsf (data[c][n]);
+			if (s > sig_lvl) {
+				init = false;
+			}
+			if (s > sig_min) {
+				silent = false;
+			}
+		}
+		if (silent) {
+			if (++t > tme_min) {
+				tme_trim = n;
+				break;
+			}
+		} else {
+			t = 0;
+		}
+	}
+
+	assert (tme_trim >= tme_min);
+
+	/* fade-out tail */
+	uint32_t off = tme_trim - tme_min;
+	for (uint32_t n = 0; n < tme_min; ++n) {
+		float g = 1.f - (n / (float)tme_min);
+		for (uint32_t c = 0; c < n_channels; ++c) {
+			data[c][off + n] *= g;
+		}
+	}
+
+	for (uint32_t c = 0; c < n_channels; ++c) {
+		memset (&data[c][tme_trim], 0, sizeof (float) * (n_samples - tme_trim));
+	}
+
+	return tme_trim;
+}
+
+/* in-place reverse prefix sum: e[n] = sum_{k >= n} e[k] */
+static void
+reverse_cumsum (float* e, uint32_t n_samples)
+{
+	const fv4 zero  = { 0, 0, 0, 0 };
+	float     carry = 0;
+	uint32_t  n     = n_samples;
+
+	while (n % 4) {
+		--n;
+		carry += e[n];
+		e[n] = carry;
+	}
+	while (n > 0) {
+		n -= 4;
+		fv4 v = *(fv4*)&e[n];
+#ifdef __clang__
+		v += __builtin_shufflevector (v, zero, 1, 2, 3, 4);
+		v += __builtin_shufflevector (v, zero, 2, 3, 4, 5);
+#else
+		v += __builtin_shuffle (v, zero, (uv4){ 1, 2, 3, 4 });
+		v += __builtin_shuffle (v, zero, (uv4){ 2, 3, 4, 5 });
+#endif
+		v += carry;
+		*(fv4*)&e[n] = v;
+		carry = v[0];
+	}
+}
+
+/* Truncate the IR where its decay meets the noise floor.
+ * The noise is estimated from the last 10% of the first n_valid samples,
+ * after that the sweep's response was not completely recorded, and the
+ * deconvolved noise fades out. The cut is placed
+ * where the noise-compensated Schroeder integral has dropped by the
+ * available decay range. Falls back to trim_end() if the IR is too short
+ * or does not decay at least 20dB into the noise.
+ * The noise RMS and the peak-to-noise ratio (energy) are returned in
+ * noise and snr, or zero if they could not be estimated.
+ */
+static uint32_t
+trim_noise (uint32_t n_channels, uint32_t rate, uint32_t n_samples, uint32_t n_valid, float** data, float* noise_rms, float* snr)
+{
+	const uint32_t tme_min = rate / 20;
+	const uint32_t n_blk   = rate / 100;
+	const uint32_t n_tail  = n_valid / 10;
+
+	*noise_rms = 0;
+	*snr       = 0;
+
+	float* e = NULL;
+	if (n_valid < 4 * tme_min || n_valid > n_samples || !(e = (float*)calloc (n_samples, sizeof (float)))) {
+		return trim_end (n_channels, rate, n_samples, data);
+	}
+
+	for (uint32_t c = 0; c < n_channels; ++c) {
+		const float* d = data[c];
+		uint32_t     n = 0;
+		for (; n + 4 <= n_samples; n += 4) {
+			const fv4 v  = *(const fv4*)&d[n];
+			*(fv4*)&e[n] += v * v;
+		}
+		for (; n < n_samples; ++n) {
+			e[n] += d[n] * d[n];
+		}
+	}
+
+	double noise = 0;
+	for (uint32_t n = n_valid - n_tail; n < n_valid; ++n) {
+		noise += e[n];
+	}
+	noise /= n_tail;
+
+	/* last 10ms block that is clearly (5dB) above the noise floor */
+	double   env_max = 0;
+	uint32_t t_cross = 0;
+	for (uint32_t b = 0; b + n_blk <= n_valid - n_tail; b += n_blk) {
+		double env = 0;
+		for (uint32_t n = b; n < b + n_blk; ++n) {
+			env += e[n];
+		}
+		env /= n_blk;
+		env_max = std::max (env_max, env);
+		if (env > noise * 3.16) {
+			t_cross = b + n_blk;
+		}
+	}
+
+	if (env_max < noise * 100 || t_cross < tme_min) {
+		free (e);
+		return trim_end (n_channels, rate, n_samples, data);
+	}
+
+	/* noise-compensated energy decay curve up to the intersection */
+	reverse_cumsum (e, t_cross);
+
+	const double range = env_max / std::max (noise, 1e-30);
+	const double edc0  = e[0] - noise * t_cross;
+
+	*noise_rms = sqrt (noise / n_channels);
+	*snr       = range;
+
+	uint32_t tme_trim = t_cross;
+	for (uint32_t n = tme_min; n < t_cross; ++n) {
+		if ((e[n] - noise * (t_cross - n)) * range <= edc0) {
+			tme_trim = n;
+			break;
+		}
+	}
+	free (e);
+
+	/* fade-out tail */
+	uint32_t off = tme_trim - tme_min;
+	for (uint32_t n = 0; n < tme_min; ++n) {
+		float g = 1.f - (n / (float)tme_min);
+		for (uint32_t c = 0; c < n_channels; ++c) {
+			data[c][off + n] *= g;
+		}
+	}
+
+	for (uint32_t c = 0; c < n_channels; ++c) {
+		memset (&data[c][tme_trim], 0, sizeof (float) * (n_samples - tme_trim));
+	}
+
+	return tme_trim;
+}
+
+static float
+digital_peak (uint32_t n_channels, uint32_t n_samples, float** data)
+{
+	float sig_max = 0;
+	for (uint32_t c = 0; c < n_channels; ++c) {
+		for (uint32_t n = 0; n < n_samples; ++n) {
+			float s = fabsf (data[c][n]);
+			if (s > sig_max) {
+				sig_max = s;
+			}
+		}
+	}
+	return sig_max;
+}
+
+/* position of the absolute peak of all channels */
+static uint32_t
+peak_position (uint32_t n_channels, uint32_t n_samples, float** data)
+{
+	float    sig_max = 0;
+	uint32_t pos     = 0;
+	for (uint32_t c = 0; c < n_channels; ++c) {
+		for (uint32_t n = 0; n < n_samples; ++n) {
+			float s = fabsf (data[c][n]);
+			if (s > sig_max) {
+				sig_max = s;
+				pos     = n;
+			}
+		}
+	}
+	return pos;
+}
+
+/* sig_max: peak of all channels, see digital_peak() */
+static float
+normalize_peak (uint32_t n_channels, uint32_t n_samples, float** data, float sig_max)
+{
+	float target = exp10f (.05 * -3);
+
+	if (sig_max == 0 || sig_max > target) {
+		return 1.0;
+	}
+
+	const float g = target / sig_max;
+	for (uint32_t c = 0; c < n_channels; ++c) {
+		for (uint32_t n = 0; n < n_samples; ++n) {
+			data[c][n] *= g;
+		}
+	}
+	return g;
+}
+
+/* in-place fast Walsh-Hadamard transform */
+static void
+fwht (float* x, uint32_t order)
+{
+	const uint32_t n_len = 1 << order;
+
+	for (uint32_t h = 1; h < n_len; h <<= 1) {
+		for (uint32_t b = 0; b < n_len; b += 2 * h) {
+			float* p = &x[b];
+			float* q = &x[b + h];
+			if (h < 4) {
+				for (uint32_t i = 0; i < h; ++i) {
+					const float a = p[i];
+					p[i]          = a + q[i];
+					q[i]          = a - q[i];
+				}
+				continue;
+			}
+			for (uint32_t i = 0; i < h; i += 4) {
+				const fv4 a = *(fv4*)&p[i];
+				const fv4 c = *(fv4*)&q[i];
+				*(fv4*)&p[i] = a + c;
+				*(fv4*)&q[i] = a - c;
+			}
+		}
+	}
+}
+
+/* Writer thread, shared by all sessions. Encoded files are queued and
+ * written in order, the queue is bounded by the number of buffers:
+ * write_acquire() blocks until one is available. Buffers are kept for reuse.
+ */
+struct WriteJob {
+	WriteBuf         buf;
+	std::string      fn;
+	IrCapture::Impl* session;
+	void*            user;
+	bool             notify; /* report the result once written */
+	CaptureResult    res;
+	uint32_t         rate;
+};
+
+static WriteJob                write_jobs[4];
+static std::vector<WriteJob*>  write_free;
+static std::deque<WriteJob*>   write_queue;
+static bool                    write_quit = false;
+static pthread_t               write_thread;
+static pthread_mutex_t         write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t          write_cond = PTHREAD_COND_INITIALIZER;
+
+/* process-wide services are started with the first session */
+static int             lib_users = 0;
+static pthread_mutex_t lib_lock  = PTHREAD_MUTEX_INITIALIZER;
+
+/* 2 ports each, within the simulation's Convproc::MAXINP,
+ * and the channels of a raw capture file */
+static const uint32_t max_groups = max_channels / 2;
+
+/* A device under test, its ports and IR channels. Groups are recorded
+ * in the same cycles, and post-processed separately.
+ */
+struct PortGroup {
+	uint32_t in0, n_in;   /* capture ports */
+	uint32_t out0, n_out; /* playback ports */
+	uint32_t c0, n_ch;    /* IR channels */
+	float    peak;        /* input peak of the current capture */
+	int      clip_chan;   /* relative to c0, -1: not clipped */
+	uint32_t clip_pos;
+};
+
+/* snapshot of a completed capture, post-processed while the next one records */
+struct PostJob {
+	std::vector<float*>      ir;
+	uint32_t                 n_ir;
+	std::vector<PortGroup>   groups;
+	uint32_t                 irrec_len;
+	uint32_t                 rate;
+	int                      latency;    /* resolved alignment */
+	uint32_t                 latency_rt; /* round-trip latency at capture time */
+	float                    in_noise;   /* probed input noise floor */
+	float                    peak;
+	bool                     complete;   /* capture was not aborted */
+	bool                     quiet;
+	bool                     first_pass; /* true-stereo, deconvolve channels 0, 1 only */
+	uint32_t                 n_done;     /* first_pass: channels deconvolved */
+	float                    done_peak;  /* first_pass: their IR peak */
+	PostJob*                 pass;       /* first_pass job of this capture, if any */
+	StageTime                t[N_STAGES];
+	std::vector<std::string> outfile;    /* per group */
+	std::string              rawfile;    /* optional, capture before deconvolution */
+	void*                    user;       /* passed to the result callback */
+	CaptureResult            res;        /* shared by all groups */
+};
+
+/* Audio I/O of a session: a JACK client, or a simulated device.
+ * It calls IrCapture::Impl::process () once per cycle, and provides
+ * the buffers of the session's ports for that cycle.
+ */
+class Backend
+{
+public:
+	virtual ~Backend () {}
+
+	virtual int      open (IrConfig const& cfg) = 0;
+	virtual uint32_t rate () const = 0;
+	virtual int      add_ports (uint32_t n_in, uint32_t n_out, bool midi) = 0;
+	virtual int      start () = 0;
+	virtual void     stop () = 0;
+	/* round-trip latency of the first n_in, n_out ports */
+	virtual uint32_t latency (uint32_t n_in, uint32_t n_out) = 0;
+
+	virtual float* capture_buffer (uint32_t port, uint32_t n_samples) = 0;
+	virtual float* playback_buffer (uint32_t port, uint32_t n_samples) = 0;
+	virtual void*  midi_buffer (uint32_t) { return NULL; }
+	virtual bool   midi () const { return false; }
+
+	/* a simulated device is always connected */
+	virtual int  connect_capture (uint32_t, std::string const&) { return 0; }
+	virtual int  connect_playback (uint32_t, std::string const&) { return 0; }
+	virtual int  connect_midi (std::string const&) { return -1; }
+	virtual void disconnect () {}
+	virtual void settle (uint32_t) {}
+	virtual bool physical (std::string const&) { return false; }
+	virtual int  freewheel (bool) { return -1; }
+};
+
+class SimBackend;
+
+/* Session state. Everything the process callback, the post-processing
+ * and live workers touch is per session; the methods keep the names of
+ * the former file-scope functions.
+ */
+struct IrCapture::Impl {
+	Impl ();
+
+	enum State {
+		Initialize,
+		Run,
+		Exit,
+		Abort
+	};
+
+	IrConfig cfg;
+
+	IrCapture::ProgressCallback progress_cb  = NULL;
+	void*                       progress_arg = NULL;
+	IrCapture::ResultCallback   result_cb    = NULL;
+	void*                       result_arg   = NULL;
+
+	Backend*       backend   = NULL;
+	SimBackend*    sim       = NULL; /* the backend, if simulated */
+	bool           lib_ref   = false;
+	uint32_t       rate      = 0;
+	uint32_t       n_capture = 0; /* captures, alternating buffer-sets */
+
+	uint32_t n_ir      = 0;
+	uint32_t n_ir_max  = 4; /* allocated entries of a buffer-set */
+	uint32_t n_inputs  = 2;
+	uint32_t n_outputs = 2;
+	uint32_t n_play    = 0; /* registered playback ports */
+	uint32_t n_port_in = 0; /* registered capture ports */
+
+	std::vector<PortGroup> groups;
+	std::vector<uint32_t>  ch_group; /* IR channel -> group */
+
+	/* MIDI program-change, queued by the main thread, sent by the next cycle */
+	uint8_t  midi_ev[3][3];
+	uint32_t midi_len[3];
+	uint32_t midi_n = 0;
+
+	bool     true_stereo      = false;
+	uint32_t true_stereo_pass = 1;
+
+	float** ir        = NULL;
+	float** ir_alt    = NULL; /* 2nd buffer-set, post-processed while capturing */
+	float*  sweep_sin = NULL;
+	float*  sweep_inv = NULL;
+
+	uint32_t sweep_len = 0;
+	uint32_t sweep_gen = 0; /* bumped by gensweep (), the deconvolver follows */
+	double   sweep_amp = 0; /* level of the current sweep */
+	uint32_t irrec_len = 0;
+	uint32_t irrec_max = 0;
+
+	uint32_t proc_pos = 0;
+	uint32_t proc_tot = 0;
+
+	uint32_t roundtrip_latency = 0;
+
+	/* maximum length sequence excitation, mls_order == 0: use sine-sweep */
+	uint32_t  mls_order   = 0;
+	uint32_t  mls_len     = 0;
+	uint32_t  mls_periods = 4;
+	uint32_t  mls_state   = 1;
+	float     mls_amp     = 0.25f;
+	float     mls_peak    = 0;
+	uint32_t* mls_tag_s   = NULL;
+	uint32_t* mls_tag_l   = NULL;
+	float*    mls_work    = NULL;
+
+	/* live monitoring, periodic MLS: the process callback fills one buffer
+	 * while the worker deconvolves the other one */
+	bool            live_mode   = false;
+	float*          live_buf[2] = { NULL, NULL };
+	uint32_t        live_wr     = 0;
+	int             live_pend   = -1;
+	float           live_peak   = 0;
+	uint32_t        live_drop   = 0;
+	uint32_t        live_lat    = 0;
+	LiveHeader*     live_shm    = NULL;
+	size_t          live_shm_sz = 0;
+	float*          live_fft    = NULL;
+	fftwf_complex*  live_frq    = NULL;
+	fftwf_plan      live_plan   = NULL;
+	pthread_mutex_t live_lock;
+	pthread_cond_t  live_cond;
+
+	volatile State client_state = Initialize;
+
+	/* JACK went away, or a user interrupt was seen by process () */
+	volatile bool interrupt = false;
+
+	/* IrCapture::interrupt (), owned by the IrCapture: a signal handler
+	 * must not touch the Impl, which close () replaces */
+	volatile sig_atomic_t* user_interrupt = NULL;
+
+	bool interrupted () const
+	{
+		return interrupt || *user_interrupt;
+	}
+
+	/* the engine runs as fast as the graph can compute, x-runs are meaningless */
+	volatile bool freewheeling = false;
+
+	/* running input peak, the capture is aborted as soon as it clips,
+	 * unless other port groups are still to be measured */
+	float in_peak   = 0;
+	int   clip_chan = -1;
+
+	/* pre-flight probe: noise floor, then a short sweep to measure the loop gain */
+	bool     probe_mode  = false;
+	uint32_t probe_noise = 0;
+	uint32_t probe_tail  = 0;
+	double   probe_sq[2] = { 0, 0 };
+	float    probe_peak  = 0;
+	float    noise_floor = 0;
+
+	/* adaptive capture length, end once the response stayed below
+	 * -60dB of the peak (or twice the noise floor) for decay_len samples. */
+	uint32_t decay_len  = 0;
+	uint32_t decay_hold = 0;
+
+	StageTime stage_time[N_STAGES]; /* main thread, taken by the next capture */
+	double    proc_cpu = 0;         /* process callback */
+
+	Deconvolver deconv;
+
+	/* post-processing worker, a single job is in flight */
+	PostJob         post_jobs[2];
+	PostJob         pass_job; /* true-stereo: the first pass of the current capture */
+	bool            pass_queued = false;
+	PostJob*        post_job    = NULL;
+	bool            post_quit   = false;
+	bool            post_failed = false;
+	bool            post_active = false;
+	pthread_t       post_thread;
+	pthread_mutex_t post_lock;
+	pthread_cond_t  post_cond;
+
+	/* files queued to the writer, protected by write_lock */
+	uint32_t write_pending = 0;
+	bool     write_failed  = false;
+
+	float    check_clip (uint32_t c, const float* d, uint32_t n, uint32_t pos);
+	bool     decay_done (float pk, uint32_t n);
+	void     process_multi_pass (jack_nframes_t n_samples);
+	void     process_single_pass (jack_nframes_t n_samples);
+	uint32_t mls_step ();
+	void     process_probe (jack_nframes_t n_samples);
+	void     live_period_done ();
+	void     process_mls (jack_nframes_t n_samples);
+	int      process (jack_nframes_t n_samples);
+	void     latency_update ();
+
+	uint32_t gensweep (float fmin, float fmax, float t_sec, float rate, double amp);
+	int      mls_setup (uint32_t order);
+	void     mls_deconv (float* data, uint32_t n_periods, uint32_t latency);
+	float    run_probe (float fmin, float fmax, float t_sec, uint32_t rate, float headroom, bool quiet);
+	int      ir_latency (int latency);
+
+	int   live_setup (const char* fn, uint32_t rate);
+	void  live_update (float* buf);
+	void* live_worker ();
+
+	void  post_prepare (PostJob* pj, uint32_t rate, int latency, std::vector<std::string> const& outfile, std::string const& rawfile, bool quiet);
+	bool  post_window (PostJob const* pj, uint32_t& ir_off, uint32_t& ir_end);
+	int   post_deconv (PostJob* pj, uint32_t c0, uint32_t n, uint32_t ir_off, uint32_t ir_end);
+	void  post_first_pass (PostJob* pj);
+	void  post_report (PostJob* pj, uint32_t g, const char* err);
+	int   post_fail (PostJob* pj, const char* err);
+	int   post_group (PostJob* pj, uint32_t g, float** win, uint32_t ir_off, uint32_t ir_end, uint32_t n_valid);
+	int   post_process (PostJob* pj);
+	void  notify (void* user, const char* file, CaptureResult const* res, uint32_t rate);
+	void* post_worker ();
+	void  post_wait ();
+	void  post_submit (PostJob* pj);
+	void  capture_poll (uint32_t rate, int latency, bool raw);
+	int   post_start ();
+	void  post_stop ();
+
+	void add_group (uint32_t n_in, uint32_t n_out, uint32_t n_ch);
+	void capture_reset (uint32_t n_rec, uint32_t n_pass);
+	int  send_program (int program, int chn, bool bank);
+	int  set_freewheel (bool onoff);
+	void stage_take (StageTime* t);
+	int  alloc_buffers (uint32_t n_ch);
+	int  open ();
+	void cleanup ();
+
+	int  connect (std::vector<std::string> const& capt, std::vector<std::string> const& play, bool ts);
+	void disconnect ();
+	int  capture (std::vector<std::string> const& outfile, std::string const& rawfile, int latency, void* user);
+	int  live (std::string const& fn);
+	bool finish ();
+};
+
+IrCapture::Impl::Impl ()
+{
+	memset (stage_time, 0, sizeof (stage_time));
+	pthread_mutex_init (&live_lock, NULL);
+	pthread_cond_init (&live_cond, NULL);
+	pthread_mutex_init (&post_lock, NULL);
+	pthread_cond_init (&post_cond, NULL);
+}
+
+static void*
+write_worker (void* arg)
+{
+	pthread_mutex_lock (&write_lock);
+	while (true) {
+		while (write_queue.empty () && !write_quit) {
+			pthread_cond_wait (&write_cond, &write_lock);
+		}
+		if (write_queue.empty ()) {
+			break;
+		}
+		WriteJob* wj = write_queue.front ();
+		write_queue.pop_front ();
+		pthread_mutex_unlock (&write_lock);
+
+		const char* err = NULL;
+		stage_begin (&wj->res.t[ST_WRITE]);
+		if (write_file (wj->fn.c_str (), &wj->buf)) {
+			err = "Cannot write IR file";
+		}
+		stage_end (&wj->res.t[ST_WRITE]);
+		if (wj->notify) {
+			wj->res.error = err;
+			wj->session->notify (wj->user, wj->fn.c_str (), &wj->res, wj->rate);
+		}
+
+		pthread_mutex_lock (&write_lock);
+		if (err) {
+			wj->session->write_failed = true;
+		}
+		--wj->session->write_pending;
+		write_free.push_back (wj);
+		pthread_cond_broadcast (&write_cond);
+	}
+	pthread_mutex_unlock (&write_lock);
+	return NULL;
+}
+
+static WriteJob*
+write_acquire ()
+{
+	pthread_mutex_lock (&write_lock);
+	while (write_free.empty ()) {
+		pthread_cond_wait (&write_cond, &write_lock);
+	}
+	WriteJob* wj = write_free.back ();
+	write_free.pop_back ();
+	pthread_mutex_unlock (&write_lock);
+	wj->user   = NULL;
+	wj->notify = false;
+	return wj;
+}
+
+static void
+write_release (WriteJob* wj)
+{
+	pthread_mutex_lock (&write_lock);
+	write_free.push_back (wj);
+	pthread_cond_broadcast (&write_cond);
+	pthread_mutex_unlock (&write_lock);
+}
+
+static void
+write_submit (WriteJob* wj)
+{
+	pthread_mutex_lock (&write_lock);
+	++wj->session->write_pending;
+	write_queue.push_back (wj);
+	pthread_cond_broadcast (&write_cond);
+	pthread_mutex_unlock (&write_lock);
+}
+
+/* encode and queue a file. With a result, the session's result
+ * callback is called once it is written.
+ */
+static int
+write_queue_file (IrCapture::Impl* s, std::string const& fn, uint32_t n_channels, uint32_t rate, uint32_t off_start, uint32_t n_frames, float** data,
+                  CaptureResult const* res = NULL, void* user = NULL)
+{
+	WriteJob* wj = write_acquire ();
+	if (res) {
+		wj->res    = *res;
+		wj->user   = user;
+		wj->notify = true;
+	}
+	stage_begin (&wj->res.t[ST_WRITE]);
+	if (sf_encode (&wj->buf, n_channels, rate, off_start, n_frames, data)) {
+		write_release (wj);
+		return -1;
+	}
+	stage_end (&wj->res.t[ST_WRITE]);
+	wj->fn      = fn;
+	wj->rate    = rate;
+	wj->session = s;
+	write_submit (wj);
+	return 0;
+}
+
+/* wait until all files of the session are written */
+static void
+write_wait (IrCapture::Impl* s)
+{
+	pthread_mutex_lock (&write_lock);
+	while (s->write_pending > 0) {
+		pthread_cond_wait (&write_cond, &write_lock);
+	}
+	pthread_mutex_unlock (&write_lock);
+}
+
+static int
+write_start ()
+{
+	write_quit = false;
+	write_free.clear ();
+	for (size_t i = 0; i < sizeof (write_jobs) / sizeof (WriteJob); ++i) {
+		write_free.push_back (&write_jobs[i]);
+	}
+#ifdef HAVE_LIBURING
+	write_ring_ok = io_uring_queue_init (8, &write_ring, 0) == 0;
+#endif
+	return pthread_create (&write_thread, NULL, write_worker, NULL);
+}
+
+/* flush the queue */
+static void
+write_stop ()
+{
+	pthread_mutex_lock (&write_lock);
+	write_quit = true;
+	pthread_cond_broadcast (&write_cond);
+	pthread_mutex_unlock (&write_lock);
+	pthread_join (write_thread, NULL);
+#ifdef HAVE_LIBURING
+	if (write_ring_ok) {
+		io_uring_queue_exit (&write_ring);
+	}
+#endif
+	for (size_t i = 0; i < sizeof (write_jobs) / sizeof (WriteJob); ++i) {
+		free (write_jobs[i].buf.data);
+		memset (&write_jobs[i].buf, 0, sizeof (WriteBuf));
+	}
+}
+
+static int
+lib_acquire ()
+{
+	int rv = 0;
+	pthread_mutex_lock (&lib_lock);
+	if (lib_users == 0) {
+		rv = write_start ();
+	}
+	if (!rv) {
+		++lib_users;
+	}
+	pthread_mutex_unlock (&lib_lock);
+	return rv;
+}
+
+/* the last session stops the writer, and frees the shared FFT plans */
+static void
+lib_release ()
+{
+	pthread_mutex_lock (&lib_lock);
+	if (--lib_users == 0) {
+		write_stop ();
+		Convplan::purge ();
+	}
+	pthread_mutex_unlock (&lib_lock);
+}
+
+float
+IrCapture::Impl::check_clip (uint32_t c, const float* d, uint32_t n, uint32_t pos)
+{
+	const float pk  = block_peak (d, n);
+	PortGroup&  grp = groups[ch_group[c]];
+	if (pk > in_peak) {
+		in_peak = pk;
+	}
+	if (pk > grp.peak) {
+		grp.peak = pk;
+	}
+	if (pk >= .98f && grp.clip_chan < 0) {
+		uint32_t i = 0;
+		while (i < n && fabsf (d[i]) < .98f) {
+			++i;
+		}
+		grp.clip_chan = c - grp.c0;
+		grp.clip_pos  = pos + i;
+		if (groups.size () == 1) {
+			clip_chan    = c;
+			client_state = Abort;
+		}
+	}
+	return pk;
+}
+
+/* the level is judged against the peak of all inputs,
+ * which is why port groups cannot use an adaptive end */
+bool
+IrCapture::Impl::decay_done (float pk, uint32_t n)
+{
+	const float thresh = std::max (in_peak * 1e-3f, 2.f * noise_floor);
+	if (pk > thresh) {
+		decay_hold = 0;
+		return false;
+	}
+	decay_hold += n;
+	return decay_hold >= decay_len;
+}
+
+void
+IrCapture::Impl::process_multi_pass (jack_nframes_t n_samples)
+{
+	assert (n_outputs == 2 && n_inputs == 2 && n_ir == 4);
+	bool fp = true_stereo_pass > 0;
+
+	if (proc_pos < sweep_len) {
+		uint32_t n_play = proc_pos + n_samples < sweep_len ? n_samples : sweep_len - proc_pos;
+		float*   out    = backend->playback_buffer (fp ? 0 : 1, n_samples);
+		memcpy (out, &sweep_sin[proc_pos], n_play * sizeof (float));
+	}
+
+	if (proc_pos < irrec_len) {
+		uint32_t n_rec = proc_pos + n_samples < irrec_len ? n_samples : irrec_len - proc_pos;
+		float    pk    = 0;
+		for (uint32_t n = 0; n < 2; ++n) {
+			float* in = backend->capture_buffer (n, n_samples);
+			memcpy (&ir[n + (fp ? 0 : 2)][proc_pos], in, n_rec * sizeof (float));
+			pk = std::max (pk, check_clip (n + (fp ? 0 : 2), in, n_rec, proc_pos));
+		}
+		/* the first pass determines the length of both */
+		if (fp && decay_len > 0 && proc_pos >= sweep_len + roundtrip_latency && decay_done (pk, n_rec)) {
+			irrec_len = proc_pos + n_rec;
+		}
+	}
+
+	proc_pos += n_samples;
+
+	if (proc_pos > irrec_len + true_stereo_pass) {
+		if (fp) {
+			proc_pos         = 0;
+			true_stereo_pass = 0;
+		} else {
+			client_state = Exit;
+		}
+	}
+}
+
+void
+IrCapture::Impl::process_single_pass (jack_nframes_t n_samples)
+{
+	assert (n_inputs == n_ir);
+
+	if (proc_pos < sweep_len) {
+		uint32_t n_play = proc_pos + n_samples < sweep_len ? n_samples : sweep_len - proc_pos;
+		for (uint32_t n = 0; n < n_outputs; ++n) {
+			float* out = backend->playback_buffer (n, n_samples);
+			memcpy (out, &sweep_sin[proc_pos], n_play * sizeof (float));
+		}
+	}
+
+	if (proc_pos < irrec_len) {
+		uint32_t n_rec = proc_pos + n_samples < irrec_len ? n_samples : irrec_len - proc_pos;
+		float    pk    = 0;
+		for (uint32_t n = 0; n < n_inputs; ++n) {
+			float* in = backend->capture_buffer (n, n_samples);
+			memcpy (&ir[n][proc_pos], in, n_rec * sizeof (float));
+			pk = std::max (pk, check_clip (n, in, n_rec, proc_pos));
+		}
+		if (decay_len > 0 && proc_pos >= sweep_len + roundtrip_latency && decay_done (pk, n_rec)) {
+			irrec_len = proc_pos + n_rec;
+		}
+	}
+
+	proc_pos += n_samples;
+
+	if (proc_pos > irrec_len) {
+		client_state = Exit;
+	}
+}
+
+inline uint32_t
+IrCapture::Impl::mls_step ()
+{
+	uint32_t bit = mls_state & 1;
+	uint32_t fb  = __builtin_parity (mls_state & mls_taps[mls_order]);
+	mls_state    = (mls_state >> 1) | (fb << (mls_order - 1));
+	return bit;
+}
+
+void
+IrCapture::Impl::process_probe (jack_nframes_t n_samples)
+{
+	const uint32_t s0 = probe_noise;
+	const uint32_t s1 = s0 + sweep_len;
+	const uint32_t s2 = s1 + probe_tail;
+
+	if (proc_pos + n_samples > s0 && proc_pos < s1) {
+		uint32_t o = proc_pos < s0 ? s0 - proc_pos : 0;
+		uint32_t n = std::min (n_samples - o, s1 - proc_pos - o);
+		for (uint32_t c = 0; c < n_outputs; ++c) {
+			float* out = backend->playback_buffer (c, n_samples);
+			memcpy (&out[o], &sweep_sin[proc_pos + o - s0], n * sizeof (float));
+		}
+	}
+
+	for (uint32_t c = 0; c < n_inputs; ++c) {
+		float* in = backend->capture_buffer (c, n_samples);
+		if (proc_pos < s0) {
+			uint32_t n = std::min (n_samples, s0 - proc_pos);
+			for (uint32_t i = 0; i < n; ++i) {
+				probe_sq[c] += in[i] * in[i];
+			}
+		}
+		if (proc_pos + n_samples > s0 && proc_pos < s2) {
+			uint32_t o = proc_pos < s0 ? s0 - proc_pos : 0;
+			uint32_t n = std::min (n_samples - o, s2 - proc_pos - o);
+			probe_peak = std::max (probe_peak, block_peak (&in[o], n));
+		}
+	}
+
+	proc_pos += n_samples;
+
+	if (proc_pos >= s2) {
+		client_state = Exit;
+	}
+}
+
+/* hand a completed period to the live worker, drop it if the worker is busy */
+void
+IrCapture::Impl::live_period_done ()
+{
+	if (__atomic_load_n (&live_pend, __ATOMIC_ACQUIRE) >= 0) {
+		++live_drop;
+		return;
+	}
+	live_peak = mls_peak;
+	mls_peak  = 0;
+	__atomic_store_n (&live_pend, (int)live_wr, __ATOMIC_RELEASE);
+	live_wr ^= 1;
+
+	if (pthread_mutex_trylock (&live_lock) == 0) {
+		pthread_cond_signal (&live_cond);
+		pthread_mutex_unlock (&live_lock);
+	}
+}
+
+void
+IrCapture::Impl::process_mls (jack_nframes_t n_samples)
+{
+	/* live mode never ends, proc_pos is kept within the 2nd period */
+	const uint32_t n_total = live_mode ? UINT32_MAX : (1 + mls_periods) * mls_len;
+
+	if (proc_pos < n_total) {
+		uint32_t n_proc = proc_pos + n_samples < n_total ? n_samples : n_total - proc_pos;
+
+		float* out[2];
+		for (uint32_t n = 0; n < n_outputs; ++n) {
+			out[n] = backend->playback_buffer (n, n_samples);
+		}
+		for (uint32_t i = 0; i < n_proc; ++i) {
+			const float v = mls_step () ? -mls_amp : mls_amp;
+			for (uint32_t n = 0; n < n_outputs; ++n) {
+				out[n][i] = v;
+			}
+		}
+
+		float* in[2];
+		for (uint32_t n = 0; n < n_inputs; ++n) {
+			in[n] = backend->capture_buffer (n, n_samples);
+		}
+
+		/* the first period lets the system settle, average the rest */
+		for (uint32_t i = 0; i < n_proc;) {
+			const uint32_t pos = proc_pos + i;
+			const uint32_t k   = pos % mls_len;
+			const uint32_t n_c = std::min (n_proc - i, mls_len - k);
+
+			if (pos >= mls_len) {
+				for (uint32_t n = 0; n < n_inputs; ++n) {
+					const float* src = &in[n][i];
+					if (live_mode) {
+						float* dst = &live_buf[live_wr][n * mls_len + k];
+						memcpy (dst, src, n_c * sizeof (float));
+						mls_peak = std::max (mls_peak, block_peak (src, n_c));
+					} else {
+						float* dst = &ir[n][k];
+						for (uint32_t j = 0; j < n_c; ++j) {
+							dst[j] += src[j];
+						}
+						check_clip (n, src, n_c, pos);
+					}
+				}
+				if (live_mode && k + n_c == mls_len) {
+					live_period_done ();
+				}
+			}
+			i += n_c;
+		}
+	}
+
+	proc_pos += n_samples;
+
+	if (live_mode) {
+		if (proc_pos >= 2 * mls_len) {
+			proc_pos -= mls_len;
+		}
+	} else if (proc_pos >= n_total) {
+		client_state = Exit;
+	}
+}
+
+int
+IrCapture::Impl::process (jack_nframes_t n_samples)
+{
+	for (uint32_t n = 0; n < n_play; ++n) {
+		float* out = backend->playback_buffer (n, n_samples);
+		memset (out, 0, sizeof (float) * n_samples);
+	}
+
+	void* mbuf = backend->midi_buffer (n_samples);
+	if (mbuf) {
+		uint32_t n_ev = __atomic_load_n (&midi_n, __ATOMIC_ACQUIRE);
+		jack_midi_clear_buffer (mbuf);
+		for (uint32_t i = 0; i < n_ev; ++i) {
+			jack_midi_event_write (mbuf, 0, midi_ev[i], midi_len[i]);
+		}
+		if (n_ev > 0) {
+			__atomic_store_n (&midi_n, 0, __ATOMIC_RELEASE);
+		}
+	}
+
+	/* IrCapture::interrupt () only sets a flag */
+	if (client_state == Run && *user_interrupt) {
+		interrupt    = true;
+		client_state = Abort;
+	}
+
+	if (client_state != Run) {
+		return 0;
+	}
+
+	const double t0 = cfg.timing ? clock_sec (CLOCK_THREAD_CPUTIME_ID) : 0;
+
+	if (probe_mode) {
+		process_probe (n_samples);
+	} else if (mls_order > 0) {
+		process_mls (n_samples);
+	} else if (true_stereo) {
+		process_multi_pass (n_samples);
+	} else {
+		process_single_pass (n_samples);
+	}
+
+	if (cfg.timing) {
+		proc_cpu += clock_sec (CLOCK_THREAD_CPUTIME_ID) - t0;
+	}
+
+	proc_tot += n_samples;
+	return 0;
+}
+
+void
+IrCapture::Impl::latency_update ()
+{
+	roundtrip_latency = backend->latency (n_inputs, n_outputs);
+}
+
+static int
+jack_process (jack_nframes_t n_samples, void* arg)
+{
+	return ((IrCapture::Impl*)arg)->process (n_samples);
+}
+
+static int
+jack_xrun (void* arg)
+{
+	IrCapture::Impl* s = (IrCapture::Impl*)arg;
+	if (s->freewheeling) {
+		return 0;
+	}
+	fprintf (stderr, "JACK x-run, aborting\n");
+	s->client_state = IrCapture::Impl::Abort;
+	return 0;
+}
+
+static void
+jack_freewheel (int starting, void* arg)
+{
+	((IrCapture::Impl*)arg)->freewheeling = starting != 0;
+}
+
+static void
+jack_shutdown (void* arg)
+{
+	IrCapture::Impl* s = (IrCapture::Impl*)arg;
+	fprintf (stderr, "JACK terminated, aborting\n");
+	s->client_state = IrCapture::Impl::Abort;
+	s->interrupt    = true;
+}
+
+static int
+jack_graph_order_cb (void* arg)
+{
+	((IrCapture::Impl*)arg)->latency_update ();
+	return 0;
+}
+
+uint32_t
+IrCapture::Impl::gensweep (float fmin, float fmax, float t_sec, float rate, double amp)
+{
+	int n_samples_pre = rate * 0.1f;
+	int n_samples_sin = rate * t_sec;
+	int n_samples_end = rate * 0.03f;
+
+	int n_samples = n_samples_pre + n_samples_sin + n_samples_end;
+
+	free (sweep_sin);
+	free (sweep_inv);
+	sweep_sin = (float*)malloc (sizeof (float) * n_samples);
+	sweep_inv = (float*)malloc (sizeof (float) * n_samples);
+	++sweep_gen;
+	sweep_amp = amp;
+
+	double a = log (fmax / fmin) / (double)n_samples_sin;
+	double b = fmin / (a * rate);
+	double r = 4.0 * a * a / amp;
+
+	for (int i = 0; i < n_samples; ++i) {
+		int j = n_samples - i - 1;
+
+		double gain = 1.0;
+		if (i < n_samples_pre) {
+			gain = sin (0.5 * M_PI * i / n_samples_pre);
+		} else if (j < n_samples_end) {
+			gain = sin (0.5 * M_PI * j / n_samples_end);
+		}
+
+		double d = b * exp (a * (i - n_samples_pre));
+		double p = d - b;
+		double x = gain * sin (2.f * M_PI * (p - floor (p)));
+
+		sweep_sin[i] = x * amp;
+		sweep_inv[j] = x * d * r;
+	}
+	return n_samples;
+}
+
+/* Prepare the permutations which map the circular cross-correlation
+ * with the MLS onto a fast Hadamard transform of size 2^order.
+ */
+int
+IrCapture::Impl::mls_setup (uint32_t order)
+{
+	const uint32_t n_len = (1 << order) - 1;
+
+	free (mls_tag_s);
+	free (mls_tag_l);
+	free (mls_work);
+	mls_tag_s = (uint32_t*)malloc (sizeof (uint32_t) * n_len);
+	mls_tag_l = (uint32_t*)malloc (sizeof (uint32_t) * n_len);
+	mls_work  = (float*)malloc (sizeof (float) * (n_len + 1));
+	uint8_t* bits = (uint8_t*)malloc (n_len);
+
+	if (!mls_tag_s || !mls_tag_l || !mls_work || !bits) {
+		free (bits);
+		return -1;
+	}
+
+	mls_order = order;
+	mls_len   = n_len;
+	mls_state = 1;
+	for (uint32_t i = 0; i < n_len; ++i) {
+		bits[i] = mls_step ();
+	}
+	/* restart, playback uses the same phase */
+	mls_state = 1;
+
+	uint32_t idx[32];
+	for (uint32_t i = 0; i < n_len; ++i) {
+		uint32_t tag = 0;
+		for (uint32_t j = 0; j < order; ++j) {
+			tag |= bits[(n_len + i - j) % n_len] << (order - 1 - j);
+		}
+		mls_tag_s[i] = tag;
+		if (!(tag & (tag - 1))) {
+			idx[__builtin_ctz (tag)] = i;
+		}
+	}
+
+	for (uint32_t i = 0; i < n_len; ++i) {
+		uint32_t tag = 0;
+		for (uint32_t j = 0; j < order; ++j) {
+			tag |= bits[(n_len + idx[j] - i) % n_len] << j;
+		}
+		mls_tag_l[i] = tag;
+	}
+
+	free (bits);
+	return 0;
+}
+
+/* Turn the sum of n_periods captured periods into the circular IR,
+ * in place, rotated so that the IR starts at data[0].
+ */
+void
+IrCapture::Impl::mls_deconv (float* data, uint32_t n_periods, uint32_t latency)
+{
+	double dc = 0;
+	for (uint32_t i = 0; i < mls_len; ++i) {
+		dc += data[i];
+	}
+
+	mls_work[0] = -dc;
+	for (uint32_t i = 0; i < mls_len; ++i) {
+		mls_work[mls_tag_s[i]] = data[i];
+	}
+
+	fwht (mls_work, mls_order);
+
+	const float g = 1.f / ((mls_len + 1.f) * mls_amp * n_periods);
+	for (uint32_t i = 0; i < mls_len; ++i) {
+		data[i] = mls_work[mls_tag_l[(i + latency) % mls_len]] * g;
+	}
+}
+
+/* Play a short sweep at -20dBFS after measuring the noise floor, and
+ * regenerate the measurement sweep at the level that leaves the given
+ * headroom, which is returned. If the probe fails, the previous sweep
+ * is restored. This must be called while the process callback is idle.
+ */
+float
+IrCapture::Impl::run_probe (float fmin, float fmax, float t_sec, uint32_t rate, float headroom, bool quiet)
+{
+	const float  probe_amp = .1f;
+	const double amp_prev  = sweep_amp;
+
+	probe_noise = rate * .2f;
+	probe_tail  = roundtrip_latency + rate * .1f;
+	probe_peak  = 0;
+	probe_sq[0] = probe_sq[1] = 0;
+	sweep_len   = gensweep (fmin, fmax, .3f, rate, probe_amp);
+	proc_pos    = 0;
+	probe_mode  = true;
+
+	client_state = Run;
+	while (client_state == Run) {
+		usleep (10000);
+	}
+	probe_mode = false;
+	proc_pos   = 0;
+
+	if (client_state != Exit) {
+		sweep_len = gensweep (fmin, fmax, t_sec, rate, amp_prev);
+		return -1;
+	}
+
+	noise_floor = sqrt (std::max (probe_sq[0], probe_sq[1]) / probe_noise);
+
+	const float target = powf (10.f, -.05f * headroom);
+	const float loop   = probe_peak / probe_amp;
+
+	/* -40 .. -1 dBFS */
+	const float amp_max = powf (10.f, -.05f);
+	float       amp     = loop > 0 ? target / loop : amp_max;
+	amp                 = std::min (amp_max, std::max (.01f, amp));
+
+	sweep_len = gensweep (fmin, fmax, t_sec, rate, amp);
+
+	if (!quiet) {
+		printf ("Probe: loop gain %.1fdB, noise floor %.1fdBFS, sweep level %.1fdBFS\n",
+		        20 * log10f (loop), 20 * log10f (noise_floor), 20 * log10f (amp));
+	}
+
+	if (probe_peak >= .98f) {
+		fprintf (stderr, "Warning: probe clipped, loop gain is underestimated\n");
+	}
+
+	const float snr = 20 * log10f (amp * loop / std::max (1e-9f, noise_floor));
+	if (snr < 40) {
+		fprintf (stderr, "Warning: expected SNR is only %.1fdB\n", snr);
+	}
+	return amp;
+}
+
+int
+IrCapture::Impl::ir_latency (int latency)
+{
+	if (latency > 0) {
+		return latency;
+	}
+#if 1 /* allow for some io-delay inaccuracy and sinc pre-ringing */
+	if (roundtrip_latency > 3) {
+		return roundtrip_latency - 4;
+	}
+#endif
+	return roundtrip_latency;
+}
+
+int
+IrCapture::Impl::live_setup (const char* fn, uint32_t rate)
+{
+	const uint32_t n_fft  = mls_len + 1;
+	const uint32_t n_bins = n_fft / 2 + 1;
+
+	for (int b = 0; b < 2; ++b) {
+		live_buf[b] = (float*)calloc (n_ir * mls_len, sizeof (float));
+		if (!live_buf[b]) {
+			return -1;
+		}
+	}
+
+	live_fft  = (float*)fftwf_malloc (n_fft * sizeof (float));
+	live_frq  = (fftwf_complex*)fftwf_malloc (n_bins * sizeof (fftwf_complex));
+	if (!live_fft || !live_frq) {
+		return -1;
+	}
+	/* shared with other sessions, the planner is not reentrant */
+	fftwf_plan c2r;
+	if (Convplan::acquire (n_fft, FFTW_ESTIMATE, &live_plan, &c2r)) {
+		live_plan = NULL;
+		return -1;
+	}
+
+	live_shm_sz = sizeof (LiveHeader) + n_ir * (mls_len + n_bins) * sizeof (float);
+
+	int fd = ::open (fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf (stderr, "Error: Not able to open live file '%s'.\n", fn);
+		return -1;
+	}
+	if (ftruncate (fd, live_shm_sz)) {
+		::close (fd);
+		return -1;
+	}
+	void* m = mmap (NULL, live_shm_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close (fd);
+	if (m == MAP_FAILED) {
+		fprintf (stderr, "Error: Not able to map live file '%s'.\n", fn);
+		return -1;
+	}
+
+	live_shm = (LiveHeader*)m;
+	memcpy (live_shm->magic, "jack-ir", 8);
+	live_shm->version    = 1;
+	live_shm->rate       = rate;
+	live_shm->n_channels = n_ir;
+	live_shm->ir_len     = mls_len;
+	live_shm->n_bins     = n_bins;
+	return 0;
+}
+
+/* deconvolve a period and publish the IR and its magnitude response */
+void
+IrCapture::Impl::live_update (float* buf)
+{
+	const uint32_t n_bins = live_shm->n_bins;
+
+	float* ir_out  = (float*)(live_shm + 1);
+	float* mag_out = ir_out + n_ir * mls_len;
+
+	__atomic_store_n (&live_shm->seq, live_shm->seq + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+	for (uint32_t c = 0; c < n_ir; ++c) {
+		float* h = &buf[c * mls_len];
+		mls_deconv (h, 1, live_lat % mls_len);
+		memcpy (&ir_out[c * mls_len], h, mls_len * sizeof (float));
+
+		memcpy (live_fft, h, mls_len * sizeof (float));
+		live_fft[mls_len] = 0;
+		fftwf_execute_dft_r2c (live_plan, live_fft, live_frq);
+
+		float* mag = &mag_out[c * n_bins];
+		for (uint32_t k = 0; k < n_bins; ++k) {
+			const float re = live_frq[k][0];
+			const float im = live_frq[k][1];
+			mag[k]         = 10.f * log10f (re * re + im * im + 1e-20f);
+		}
+	}
+
+	live_shm->peak      = live_peak;
+	live_shm->n_dropped = live_drop;
+	live_shm->n_updates++;
+
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	__atomic_store_n (&live_shm->seq, live_shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* a JACK client, the process callback drives the session */
+class JackBackend : public Backend
+{
+public:
+	JackBackend (IrCapture::Impl* s)
+		: _s (s)
+		, _client (NULL)
+		, _midi (NULL)
+	{
+	}
+
+	int      open (IrConfig const& cfg);
+	uint32_t rate () const;
+	int      add_ports (uint32_t n_in, uint32_t n_out, bool midi);
+	int      start ();
+	void     stop ();
+	uint32_t latency (uint32_t n_in, uint32_t n_out);
+
+	float* capture_buffer (uint32_t port, uint32_t n_samples)
+	{
+		return (float*)jack_port_get_buffer (_in[port], n_samples);
+	}
+
+	float* playback_buffer (uint32_t port, uint32_t n_samples)
+	{
+		return (float*)jack_port_get_buffer (_out[port], n_samples);
+	}
+
+	void* midi_buffer (uint32_t n_samples)
+	{
+		return _midi ? jack_port_get_buffer (_midi, n_samples) : NULL;
+	}
+
+	bool midi () const { return _midi != NULL; }
+
+	int  connect_capture (uint32_t port, std::string const& src);
+	int  connect_playback (uint32_t port, std::string const& dst);
+	int  connect_midi (std::string const& dst);
+	void disconnect ();
+	void settle (uint32_t usec);
+	bool physical (std::string const& port);
+	int  freewheel (bool onoff);
+
+private:
+	IrCapture::Impl*          _s;
+	jack_client_t*            _client;
+	std::vector<jack_port_t*> _in;
+	std::vector<jack_port_t*> _out;
+	jack_port_t*              _midi;
+};
+
+int
+JackBackend::open (IrConfig const& cfg)
+{
+	jack_status_t status;
+	/* open a client connection to the JACK server */
+	_client = jack_client_open (cfg.client_name.c_str (), JackNoStartServer, &status, NULL);
+
+	if (!_client) {
+		fprintf (stderr, "jack_client_open() failed (status 0x%x)\n", status);
+		if (status & JackServerFailed) {
+			fprintf (stderr, "Unable to connect to JACK server\n");
+		}
+		return -1;
+	}
+
+	jack_set_process_callback (_client, jack_process, _s);
+	jack_set_graph_order_callback (_client, jack_graph_order_cb, _s);
+	jack_on_shutdown (_client, jack_shutdown, _s);
+	jack_set_freewheel_callback (_client, jack_freewheel, _s);
+	if (cfg.xrun_abort) {
+		jack_set_xrun_callback (_client, jack_xrun, _s);
+	}
+	return 0;
+}
+
+uint32_t
+JackBackend::rate () const
+{
+	return jack_get_sample_rate (_client);
+}
+
+int
+JackBackend::add_ports (uint32_t n_in, uint32_t n_out, bool midi)
+{
+	for (uint32_t n = 0; n < n_out; ++n) {
+		char tmp[64];
+		snprintf (tmp, sizeof (tmp), "sweep_%d", n + 1);
+		jack_port_t* port = jack_port_register (_client, tmp,
+		                                        JACK_DEFAULT_AUDIO_TYPE,
+		                                        JackPortIsOutput, 0);
+		if (!port) {
+			fprintf (stderr, "No more JACK ports available\n");
+			return -1;
+		}
+		_out.push_back (port);
+	}
+
+	for (uint32_t n = 0; n < n_in; ++n) {
+		char tmp[64];
+		snprintf (tmp, sizeof (tmp), "input_%d", n + 1);
+		jack_port_t* port = jack_port_register (_client, tmp,
+		                                        JACK_DEFAULT_AUDIO_TYPE,
+		                                        JackPortIsInput, 0);
+		if (!port) {
+			fprintf (stderr, "No more JACK ports available\n");
+			return -1;
+		}
+		_in.push_back (port);
+	}
+
+	if (midi) {
+		_midi = jack_port_register (_client, "midi_out",
+		                            JACK_DEFAULT_MIDI_TYPE,
+		                            JackPortIsOutput, 0);
+		if (!_midi) {
+			fprintf (stderr, "No more JACK ports available\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+JackBackend::start ()
+{
+	if (jack_activate (_client)) {
+		fprintf (stderr, "Cannot activate JACK client");
+		return -1;
+	}
+	return 0;
+}
+
+void
+JackBackend::stop ()
+{
+	if (_client) {
+		jack_client_close (_client);
+		_client = NULL;
+	}
+	_in.clear ();
+	_out.clear ();
+	_midi = NULL;
+}
+
+uint32_t
+JackBackend::latency (uint32_t n_in, uint32_t n_out)
+{
+	uint32_t worst_capture  = 0;
+	uint32_t worst_playback = 0;
+	for (uint32_t n = 0; n < n_in; ++n) {
+		jack_latency_range_t lr;
+		jack_port_get_latency_range (_in[n], JackCaptureLatency, &lr);
+		if (lr.max > worst_capture) {
+			worst_capture = lr.max;
+		}
+	}
+	for (uint32_t n = 0; n < n_out; ++n) {
+		jack_latency_range_t lr;
+		jack_port_get_latency_range (_out[n], JackPlaybackLatency, &lr);
+		if (lr.max > worst_playback) {
+			worst_playback = lr.max;
+		}
+	}
+	return worst_capture + worst_playback;
+}
+
+int
+JackBackend::connect_capture (uint32_t port, std::string const& src)
+{
+	int rv = jack_connect (_client, src.c_str (), jack_port_name (_in[port]));
+	return rv && rv != EEXIST ? -1 : 0;
+}
+
+int
+JackBackend::connect_playback (uint32_t port, std::string const& dst)
+{
+	int rv = jack_connect (_client, jack_port_name (_out[port]), dst.c_str ());
+	return rv && rv != EEXIST ? -1 : 0;
+}
+
+int
+JackBackend::connect_midi (std::string const& dst)
+{
+	if (!_midi) {
+		return -1;
+	}
+	return jack_connect (_client, jack_port_name (_midi), dst.c_str ());
+}
+
+void
+JackBackend::disconnect ()
+{
+	for (uint32_t n = 0; n < _out.size (); ++n) {
+		jack_port_disconnect (_client, _out[n]);
+	}
+	for (uint32_t n = 0; n < _in.size (); ++n) {
+		jack_port_disconnect (_client, _in[n]);
+	}
+}
+
+/* let new connections and their latencies propagate */
+void
+JackBackend::settle (uint32_t usec)
+{
+	usleep (usec);
+}
+
+bool
+JackBackend::physical (std::string const& name)
+{
+	jack_port_t* port = jack_port_by_name (_client, name.c_str ());
+	return port && (jack_port_flags (port) & JackPortIsPhysical);
+}
+
+int
+JackBackend::freewheel (bool onoff)
+{
+	return jack_set_freewheel (_client, onoff ? 1 : 0);
+}
+
+/* A simulated device under test: a thread drives the process callback
+ * faster than realtime, and convolves the playback ports with a known
+ * IR into the capture ports, after a delay and with gain, noise and
+ * drive applied.
+ */
+class SimBackend : public Backend
+{
+public:
+	SimBackend (IrCapture::Impl* s);
+
+	int      open (IrConfig const& cfg);
+	uint32_t rate () const { return _par.rate; }
+	int      add_ports (uint32_t n_in, uint32_t n_out, bool midi);
+	int      start ();
+	void     stop ();
+	uint32_t latency (uint32_t, uint32_t);
+
+	float* capture_buffer (uint32_t port, uint32_t) { return _buf[_n_out + port]; }
+	float* playback_buffer (uint32_t port, uint32_t) { return _buf[port]; }
+
+	void  stats_reset ();
+	void  stats_print (bool quiet);
+	int   verify (uint32_t n_ch, uint32_t n_samples, float** data, int offset, bool quiet);
+	void* worker ();
+
+private:
+	int  load_ir ();
+	void cycle ();
+
+	IrCapture::Impl*    _s;
+	SimParams           _par;
+	uint32_t            _n_in;
+	uint32_t            _n_out;
+	Convproc            _conv;
+	float*              _ir;
+	uint32_t            _ir_len;
+	std::vector<float*> _buf; /* playback ports, then capture ports */
+	std::vector<float*> _dly;
+	uint32_t            _rng;
+	uint64_t            _frames; /* processed while capturing */
+	double              _time;   /* wall-time spent for those */
+	volatile bool       _quit;
+	bool                _active;
+	pthread_t           _thread;
+};
+
+SimBackend::SimBackend (IrCapture::Impl* s)
+	: _s (s)
+	, _n_in (0)
+	, _n_out (0)
+	, _ir (NULL)
+	, _ir_len (0)
+	, _rng (1)
+	, _frames (0)
+	, _time (0)
+	, _quit (false)
+	, _active (false)
+{
+	SimParams dflt = { 48000, 256, 64, -6.f, -90.f, 0.f, .3f, "", 0, -1 };
+	_par           = dflt;
+}
+
+int
+SimBackend::open (IrConfig const& cfg)
+{
+	if (!sim_parse (_par, cfg.sim.c_str ())) {
+		fprintf (stderr, "Invalid simulation parameters '%s'\n", cfg.sim.c_str ());
+		return -1;
+	}
+	return 0;
+}
+
+int
+SimBackend::add_ports (uint32_t n_in, uint32_t n_out, bool)
+{
+	_n_in  = n_in;
+	_n_out = n_out;
+	return 0;
+}
+
+/* the sweep is captured in the next cycle, and delayed */
+uint32_t
+SimBackend::latency (uint32_t, uint32_t)
+{
+	return _par.period + _par.delay;
+}
+
+int
+SimBackend::load_ir ()
+{
+	if (_par.ir_file.empty ()) {
+		/* unit impulse, followed by exponentially decaying noise,
+		 * -60dB at the end, tail energy -10dB relative to the impulse */
+		const uint32_t len = std::max<uint32_t> (1, _par.rt60 * _par.rate);
+		const float    a   = sqrtf (3.f * 2.f * 6.9078f * .1f / len);
+		const uint32_t n_k = 63;
+
+		float* raw = (float*)calloc (len, sizeof (float));
+		_ir_len    = len + n_k - 1;
+		_ir        = (float*)calloc (_ir_len, sizeof (float));
+		if (!raw || !_ir) {
+			free (raw);
+			return -1;
+		}
+		uint32_t rng = 12345;
+		raw[0]       = 1.f;
+		for (uint32_t n = 1; n < len; ++n) {
+			rng    = rng * 1103515245 + 12345;
+			float r = (rng >> 9) / 4194304.f - 1.f;
+			raw[n] = a * r * expf (-6.9078f * n / len);
+		}
+
+		/* band-limit to 0.3 * rate, well inside the sweep's range,
+		 * so that it can be recovered exactly (Blackman windowed sinc) */
+		float k[n_k];
+		for (uint32_t i = 0; i < n_k; ++i) {
+			const double x = i - (n_k - 1) / 2.0;
+			const double w = .42 - .5 * cos (2 * M_PI * i / (n_k - 1)) + .08 * cos (4 * M_PI * i / (n_k - 1));
+			k[i]           = w * (x == 0 ? .6 : sin (.6 * M_PI * x) / (M_PI * x));
+		}
+		for (uint32_t n = 0; n < len; ++n) {
+			for (uint32_t i = 0; i < n_k; ++i) {
+				_ir[n + i] += raw[n] * k[i];
+			}
+		}
+		free (raw);
+		return 0;
+	}
+
+	SF_INFO  nfo;
+	SNDFILE* file;
+	memset (&nfo, 0, sizeof (nfo));
+	if (!(file = sf_open (_par.ir_file.c_str (), SFM_READ, &nfo))) {
+		fprintf (stderr, "Cannot open IR file '%s'\n", _par.ir_file.c_str ());
+		return -1;
+	}
+	if ((uint32_t)nfo.samplerate != _par.rate) {
+		fprintf (stderr, "Warning: IR sample-rate does not match the simulation (%d != %u)\n", nfo.samplerate, _par.rate);
+	}
+
+	float* buf = (float*)malloc (nfo.frames * nfo.channels * sizeof (float));
+	_ir        = (float*)calloc (nfo.frames, sizeof (float));
+	_ir_len    = nfo.frames;
+
+	int rv = -1;
+	if (buf && _ir && nfo.frames > 0 && sf_readf_float (file, buf, nfo.frames) == nfo.frames) {
+		/* first channel only */
+		for (sf_count_t n = 0; n < nfo.frames; ++n) {
+			_ir[n] = buf[n * nfo.channels];
+		}
+		rv = 0;
+	}
+	free (buf);
+	sf_close (file);
+	return rv;
+}
+
+void
+SimBackend::cycle ()
+{
+	const uint32_t P   = _par.period;
+	const float    g   = exp10f (.05f * _par.gain);
+	const float    nlv = _par.noise > -150 ? exp10f (.05f * _par.noise) * 1.7320508f : 0;
+
+	for (uint32_t i = 0; i < _n_in; ++i) {
+		float* in = _buf[_n_out + i];
+		memcpy (in, _dly[i], P * sizeof (float));
+		for (uint32_t n = 0; n < P && nlv > 0; ++n) {
+			_rng = _rng * 1103515245 + 12345;
+			in[n] += nlv * ((_rng >> 9) / 4194304.f - 1.f);
+		}
+	}
+
+	_s->process (P);
+
+	for (uint32_t o = 0; o < _n_out; ++o) {
+		memcpy (_conv.inpdata (o), _buf[o], P * sizeof (float));
+	}
+
+	_conv.process (true);
+
+	for (uint32_t i = 0; i < _n_in; ++i) {
+		float const* y = _conv.outdata (i);
+		float*       d = _dly[i];
+		memmove (d, &d[P], _par.delay * sizeof (float));
+		for (uint32_t n = 0; n < P; ++n) {
+			float x           = g * y[n];
+			d[_par.delay + n] = _par.drive > 0 ? tanhf (_par.drive * x) / _par.drive : x;
+		}
+	}
+}
+
+void*
+SimBackend::worker ()
+{
+	while (!_quit) {
+		if (_s->client_state != IrCapture::Impl::Run) {
+			usleep (1000);
+			continue;
+		}
+		struct timespec t0, t1;
+		clock_gettime (CLOCK_MONOTONIC, &t0);
+		cycle ();
+		clock_gettime (CLOCK_MONOTONIC, &t1);
+		_time += (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+		_frames += _par.period;
+	}
+	return NULL;
+}
+
+static void*
+sim_worker (void* arg)
+{
+	return ((SimBackend*)arg)->worker ();
+}
+
+/* allocate the port buffers, and start processing */
+int
+SimBackend::start ()
+{
+	if (load_ir ()) {
+		fprintf (stderr, "Cannot start simulation\n");
+		return -1;
+	}
+	_buf.assign (_n_out + _n_in, NULL);
+	_dly.assign (_n_in, NULL);
+	for (uint32_t n = 0; n < _buf.size (); ++n) {
+		if (!(_buf[n] = (float*)calloc (_par.period, sizeof (float)))) {
+			return -1;
+		}
+	}
+	for (uint32_t i = 0; i < _n_in; ++i) {
+		if (!(_dly[i] = (float*)calloc (_par.delay + _par.period, sizeof (float)))) {
+			return -1;
+		}
+	}
+
+	if (_conv.configure (_n_out, _n_in, _ir_len, _par.period, _par.period, Convproc::MAXPART, 0)
+	    || _conv.impdata_create (0, 0, 1, _ir, 0, _ir_len)) {
+		fprintf (stderr, "Cannot start simulation\n");
+		return -1;
+	}
+	/* each group's inputs are fed by its own outputs */
+	for (uint32_t g = 0; g < _s->groups.size (); ++g) {
+		PortGroup const& grp = _s->groups[g];
+		for (uint32_t r = 0; r < grp.n_in; ++r) {
+			const uint32_t i = grp.in0 + r;
+			const uint32_t o = grp.out0 + std::min (r, grp.n_out - 1);
+			if (i > 0 && _conv.impdata_link (0, 0, o, i)) {
+				return -1;
+			}
+		}
+	}
+	if (_conv.start_process (0, 0)) {
+		fprintf (stderr, "Cannot start simulation\n");
+		return -1;
+	}
+
+	if (pthread_create (&_thread, NULL, sim_worker, this)) {
+		fprintf (stderr, "Cannot start simulation\n");
+		return -1;
+	}
+	_active = true;
+	return 0;
+}
+
+void
+SimBackend::stop ()
+{
+	if (_active) {
+		_quit = true;
+		pthread_join (_thread, NULL);
+		_active = false;
+	}
+	_conv.stop_process ();
+	_conv.cleanup ();
+	for (uint32_t n = 0; n < _buf.size (); ++n) {
+		free (_buf[n]);
+	}
+	for (uint32_t n = 0; n < _dly.size (); ++n) {
+		free (_dly[n]);
+	}
+	_buf.clear ();
+	_dly.clear ();
+	free (_ir);
+	_ir = NULL;
+}
+
+void
+SimBackend::stats_reset ()
+{
+	_frames = 0;
+	_time   = 0;
+}
+
+void
+SimBackend::stats_print (bool quiet)
+{
+	if (!quiet && _time > 0) {
+		printf ("Simulation: %.1f sec captured in %.2f sec, %.0fx realtime\n",
+		        _frames / (double)_par.rate, _time, _frames / (_par.rate * _time));
+	}
+}
+
+/* compare the recovered IR to the simulated one. With true-stereo only
+ * channels 1 and 4 have a path, 2 and 3 are reported as crosstalk.
+ * Returns -1 if a channel exceeds the configured error or alignment limit.
+ */
+int
+SimBackend::verify (uint32_t n_ch, uint32_t n_samples, float** data, int offset, bool quiet)
+{
+	uint32_t h_pk = 0;
+	for (uint32_t n = 1; n < _ir_len; ++n) {
+		if (fabsf (_ir[n]) > fabsf (_ir[h_pk])) {
+			h_pk = n;
+		}
+	}
+
+	int rv = 0;
+	for (uint32_t c = 0; c < n_ch; ++c) {
+		const float* d    = data[c];
+		const bool   path = n_ch != 4 || c == 0 || c == 3;
+		uint32_t     d_pk = 0;
+		double       dh   = 0;
+		double       hh   = 0;
+		double       dd   = 0;
+
+		/* the IR is expected to start at offset */
+		for (uint32_t n = 0; n < n_samples; ++n) {
+			int   i = (int)n - offset;
+			float h = i >= 0 && i < (int)_ir_len ? _ir[i] : 0;
+			dh += d[n] * h;
+			hh += h * h;
+			dd += d[n] * d[n];
+			if (fabsf (d[n]) > fabsf (d[d_pk])) {
+				d_pk = n;
+			}
+		}
+
+		if (!path) {
+			if (!quiet) {
+				printf ("Simulation: channel %u, crosstalk: %.1fdBFS\n", c + 1, 10 * log10 (dd / n_samples + 1e-30));
+			}
+			continue;
+		}
+
+		/* least-squares scale, the IR is normalized */
+		double    s     = hh > 0 ? dh / hh : 0;
+		double    err   = dd - 2 * s * dh + s * s * hh;
+		const int align = (int)d_pk - (int)h_pk - offset;
+		const float db  = 10 * log10 (std::max (err, 1e-30) / std::max (s * s * hh, 1e-30));
+		if (!quiet) {
+			printf ("Simulation: channel %u, error: %.1fdB, alignment: %+d spl\n", c + 1, db, align);
+		}
+
+		if ((_par.max_error < 0 && db > _par.max_error) || (_par.max_align >= 0 && abs (align) > _par.max_align)) {
+			fprintf (stderr, "Simulation: channel %u exceeds the limits, error: %.1fdB, alignment: %+d spl\n", c + 1, db, align);
+			rv = -1;
+		}
+	}
+	return rv;
+}
+
+void
+IrCapture::Impl::post_prepare (PostJob* pj, uint32_t rate, int latency, std::vector<std::string> const& outfile, std::string const& rawfile, bool quiet)
+{
+	pj->ir.assign (ir, ir + n_ir);
+	pj->n_ir       = n_ir;
+	pj->groups     = groups;
+	pj->irrec_len  = irrec_len;
+	pj->rate       = rate;
+	pj->latency    = ir_latency (latency);
+	pj->latency_rt = roundtrip_latency;
+	pj->in_noise   = noise_floor;
+	pj->peak       = in_peak;
+	pj->complete   = client_state == Exit;
+	pj->quiet      = quiet;
+	pj->outfile    = outfile;
+	pj->rawfile    = rawfile;
+	pj->user       = NULL;
+	pj->first_pass = false;
+	pj->n_done     = 0;
+	pj->done_peak  = 0;
+	pj->pass       = pass_queued ? &pass_job : NULL;
+}
+
+/* IR window of a capture: after the sweep and latency */
+bool
+IrCapture::Impl::post_window (PostJob const* pj, uint32_t& ir_off, uint32_t& ir_end)
+{
+	ir_off = sweep_len + pj->latency;
+	ir_end = sweep_len + pj->irrec_len;
+	return ir_end > ir_off + pj->rate / 20;
+}
+
+/* deconvolve channels [c0, c0 + n) of the IR window */
+int
+IrCapture::Impl::post_deconv (PostJob* pj, uint32_t c0, uint32_t n, uint32_t ir_off, uint32_t ir_end)
+{
+	if (n == 0) {
+		return 0;
+	}
+	return deconv.configure (n, sweep_inv, sweep_len, sweep_gen) || deconv.process (ir_end, &pj->ir[c0], ir_off);
+}
+
+/* true-stereo: the first pass is deconvolved and peak-scanned
+ * while the second one is being recorded.
+ */
+void
+IrCapture::Impl::post_first_pass (PostJob* pj)
+{
+	uint32_t ir_off, ir_end;
+	pj->n_done    = 0;
+	pj->done_peak = 0;
+
+	StageTime* t = &pj->res.t[ST_DECONV];
+	t->wall = t->cpu = 0;
+
+	stage_begin (t);
+	if (!post_window (pj, ir_off, ir_end) || post_deconv (pj, 0, 2, ir_off, ir_end)) {
+		/* leave it to the final assembly to fail */
+		stage_end (t);
+		return;
+	}
+	stage_end (t);
+
+	float* win[2] = { &pj->ir[0][ir_off], &pj->ir[1][ir_off] };
+	pj->done_peak = digital_peak (2, ir_end - ir_off, win);
+	pj->n_done    = 2;
+}
+
+/* report a failed group */
+void
+IrCapture::Impl::post_report (PostJob* pj, uint32_t g, const char* err)
+{
+	CaptureResult res = pj->res;
+	res.error         = err;
+	res.peak          = pj->groups[g].peak;
+	res.n_channels    = pj->groups[g].n_ch;
+	notify (pj->user, pj->outfile[g].c_str (), &res, pj->rate);
+}
+
+/* the capture failed, report all groups that did not clip */
+int
+IrCapture::Impl::post_fail (PostJob* pj, const char* err)
+{
+	for (uint32_t g = 0; g < pj->groups.size (); ++g) {
+		if (pj->groups[g].clip_chan < 0) {
+			post_report (pj, g, err);
+		}
+	}
+	return -1;
+}
+
+/* normalize, trim and write the IR of a port group */
+int
+IrCapture::Impl::post_group (PostJob* pj, uint32_t g, float** win, uint32_t ir_off, uint32_t ir_end, uint32_t n_valid)
+{
+	PortGroup const& grp    = pj->groups[g];
+	CaptureResult    res    = pj->res;
+	const uint32_t   n_ch   = grp.n_ch;
+	const uint32_t   rate   = pj->rate;
+	const int        lat    = pj->latency;
+	const uint32_t   n_done = pj->pass ? pj->pass->n_done : 0;
+
+	res.peak       = grp.peak;
+	res.n_channels = n_ch;
+
+	if (!pj->quiet && pj->groups.size () > 1) {
+		printf ("Group %u: input signal peak: %.2fdBFS\n", g + 1, 20 * log10 (grp.peak));
+	}
+
+	/* shared normalization, the first pass may already be scanned */
+	stage_begin (&res.t[ST_NORMALIZE]);
+	float sig_max = std::max (pj->pass ? pj->pass->done_peak : 0.f, digital_peak (n_ch - n_done, ir_end - ir_off, &win[n_done]));
+	float gain    = normalize_peak (n_ch, ir_end - ir_off, win, sig_max);
+	stage_end (&res.t[ST_NORMALIZE]);
+	if (!pj->quiet) {
+		printf ("Normalized IR, gain-factor: %.2fdB\n", 20 * log10 (gain));
+	}
+
+	stage_begin (&res.t[ST_TRIM]);
+	uint32_t ir_len = trim_noise (n_ch, rate, ir_end - ir_off, n_valid, win, &res.noise, &res.snr);
+	stage_end (&res.t[ST_TRIM]);
+
+	/* the direct path: the sweep, convolved with its inverse, peaks at sweep_len - 1 */
+	res.latency_ir = lat + peak_position (n_ch, ir_len, win) + (mls_order > 0 ? 0 : 1);
+
+	if (sim && sim->verify (n_ch, ir_len, win, pj->latency_rt - lat - 1, pj->quiet)) {
+		res.error = "Simulation check failed";
+		notify (pj->user, pj->outfile[g].c_str (), &res, rate);
+		return -1;
+	}
+
+	if (!pj->quiet) {
+		printf ("Writing IR: %d channels, %.1f [sec] = %d [spl] '%s'\n", n_ch, ir_len / (float)rate, ir_len, pj->outfile[g].c_str ());
+	}
+
+	res.gain   = gain;
+	res.ir_len = ir_len;
+
+	/* the writer-thread reports the result */
+	if (write_queue_file (this, pj->outfile[g], n_ch, rate, 0, ir_len, win, &res, pj->user)) {
+		res.error = "Cannot write IR file";
+		notify (pj->user, pj->outfile[g].c_str (), &res, rate);
+		return -1;
+	}
+	return 0;
+}
+
+/* deconvolve a completed capture, then normalize, trim and write
+ * the IR of each port group. Failures are reported per group.
+ */
+int
+IrCapture::Impl::post_process (PostJob* pj)
+{
+	CaptureResult* res  = &pj->res;
+	float**        buf  = &pj->ir[0];
+	const uint32_t n_ch = pj->n_ir;
+	const uint32_t rate = pj->rate;
+	const int      lat  = pj->latency;
+	int            rv   = 0;
+
+	memset (res, 0, sizeof (CaptureResult));
+	memcpy (res->t, pj->t, sizeof (res->t));
+	res->peak       = pj->peak;
+	res->latency    = lat;
+	res->latency_rt = pj->latency_rt;
+	res->n_channels = n_ch;
+	res->in_noise   = pj->in_noise;
+
+	/* a clipped group does not prevent measuring the others */
+	uint32_t n_clip = 0;
+	for (uint32_t g = 0; g < pj->groups.size (); ++g) {
+		PortGroup const& grp = pj->groups[g];
+		if (grp.clip_chan < 0) {
+			continue;
+		}
+		fprintf (stderr, "Input signal clipped! Channel %d at %.2f sec\n", grp.c0 + grp.clip_chan + 1, grp.clip_pos / (float)rate);
+		post_report (pj, g, "Input signal clipped");
+		rv = -1;
+		++n_clip;
+	}
+
+	if (n_clip == pj->groups.size ()) {
+		return -1;
+	}
+
+	/* post-process, if capture was not aborted */
+	if (!pj->complete) {
+		return post_fail (pj, "Capture aborted");
+	}
+
+	if (!pj->quiet) {
+		printf ("Input signal peak: %.2fdBFS\n", 20 * log10 (pj->peak));
+	}
+
+	if (!pj->rawfile.empty () && write_queue_file (this, pj->rawfile, n_ch, rate, 0, pj->irrec_len, buf)) {
+		fprintf (stderr, "Cannot write raw capture\n");
+	}
+
+	/* only the IR after the sweep and latency is kept,
+	 * deconvolve just that window, all groups at once */
+	uint32_t ir_off, ir_end;
+	bool     ir_ok  = post_window (pj, ir_off, ir_end);
+	uint32_t n_done = pj->pass ? pj->pass->n_done : 0;
+
+	if (n_done > 0) {
+		res->t[ST_DECONV] = pj->pass->res.t[ST_DECONV];
+	}
+
+	if (mls_order == 0 && !ir_ok) {
+		fprintf (stderr, "IR is too short or empty\n");
+		return post_fail (pj, "IR is too short or empty");
+	}
+
+	stage_begin (&res->t[ST_DECONV]);
+	if (mls_order > 0) {
+		/* the MLS response is circular, rotate latency out */
+		for (uint32_t c = 0; c < n_ch; ++c) {
+			mls_deconv (buf[c], mls_periods, lat % mls_len);
+		}
+		ir_off = 0;
+	} else if (post_deconv (pj, n_done, n_ch - n_done, ir_off, ir_end)) {
+		stage_end (&res->t[ST_DECONV]);
+		fprintf (stderr, "Deconvolution failed\n");
+		return post_fail (pj, "Deconvolution failed");
+	}
+	stage_end (&res->t[ST_DECONV]);
+
+	std::vector<float*> win (n_ch);
+	for (uint32_t c = 0; c < n_ch; ++c) {
+		win[c] = &buf[c][ir_off];
+	}
+
+	/* output after the recorded length is only partially deconvolved */
+	uint32_t n_valid = ir_end - ir_off;
+	if (mls_order == 0) {
+		n_valid = pj->irrec_len > ir_off ? pj->irrec_len - ir_off : 0;
+	}
+
+	for (uint32_t g = 0; g < pj->groups.size (); ++g) {
+		PortGroup const& grp = pj->groups[g];
+		if (grp.clip_chan < 0 && post_group (pj, g, &win[grp.c0], ir_off, ir_end, n_valid)) {
+			rv = -1;
+		}
+	}
+	return rv;
+}
+
+void
+IrCapture::Impl::notify (void* user, const char* file, CaptureResult const* res, uint32_t rate)
+{
+	if (result_cb) {
+		result_cb (result_arg, user, file, res, rate);
+	}
+}
+
+/* Post-processing worker. A single job is in flight: post_submit() waits
+ * until the previous one is done, whose buffers are then reused for the
+ * next capture.
+ */
+void*
+IrCapture::Impl::post_worker ()
+{
+	pthread_mutex_lock (&post_lock);
+	while (true) {
+		while (!post_job && !post_quit) {
+			pthread_cond_wait (&post_cond, &post_lock);
+		}
+		if (!post_job) {
+			break;
+		}
+		PostJob* pj = post_job;
+		pthread_mutex_unlock (&post_lock);
+
+		/* on success, the writer-thread reports the result */
+		if (pj->first_pass) {
+			post_first_pass (pj);
+		} else if (post_process (pj)) {
+			post_failed = true;
+		}
+		pj->user = NULL;
+
+		pthread_mutex_lock (&post_lock);
+		post_job = NULL;
+		pthread_cond_broadcast (&post_cond);
+	}
+	pthread_mutex_unlock (&post_lock);
+	return NULL;
+}
+
+static void*
+post_worker (void* arg)
+{
+	return ((IrCapture::Impl*)arg)->post_worker ();
+}
+
+void
+IrCapture::Impl::post_wait ()
+{
+	pthread_mutex_lock (&post_lock);
+	while (post_job) {
+		pthread_cond_wait (&post_cond, &post_lock);
+	}
+	pthread_mutex_unlock (&post_lock);
+}
+
+/* hand over a job, the capture is swapped to the other buffer-set by the caller */
+void
+IrCapture::Impl::post_submit (PostJob* pj)
+{
+	pthread_mutex_lock (&post_lock);
+	while (post_job) {
+		pthread_cond_wait (&post_cond, &post_lock);
+	}
+	post_job = pj;
+	pthread_cond_broadcast (&post_cond);
+	pthread_mutex_unlock (&post_lock);
+}
+
+/* called periodically during a capture. Once the second true-stereo pass
+ * is playing, the first one is handed over to be deconvolved meanwhile,
+ * unless the raw capture is to be saved.
+ */
+void
+IrCapture::Impl::capture_poll (uint32_t rate, int latency, bool raw)
+{
+	if (raw || pass_queued || client_state == Abort || __atomic_load_n (&true_stereo_pass, __ATOMIC_ACQUIRE) > 0) {
+		return;
+	}
+	/* the previous capture may still use pass_job */
+	post_wait ();
+	post_prepare (&pass_job, rate, latency, std::vector<std::string> (), "", true);
+	pass_job.first_pass = true;
+	pass_queued         = true;
+	post_submit (&pass_job);
+}
+
+int
+IrCapture::Impl::post_start ()
+{
+	if (pthread_create (&post_thread, NULL, ::post_worker, this)) {
+		return -1;
+	}
+	post_active = true;
+	return 0;
+}
+
+void
+IrCapture::Impl::post_stop ()
+{
+	if (!post_active) {
+		return;
+	}
+	post_wait ();
+	pthread_mutex_lock (&post_lock);
+	post_quit = true;
+	pthread_cond_broadcast (&post_cond);
+	pthread_mutex_unlock (&post_lock);
+	pthread_join (post_thread, NULL);
+	post_active = false;
+}
+
+/* prepare for a new capture, irrec_len may have been shortened by the last one */
+void
+IrCapture::Impl::capture_reset (uint32_t n_rec, uint32_t n_pass)
+{
+	proc_pos         = 0;
+	proc_tot         = 0;
+	in_peak          = 0;
+	clip_chan        = -1;
+	decay_hold       = 0;
+	irrec_len        = n_rec;
+	true_stereo_pass = n_pass;
+	mls_state        = 1;
+	pass_queued      = false;
+
+	for (uint32_t g = 0; g < groups.size (); ++g) {
+		groups[g].peak      = 0;
+		groups[g].clip_chan = -1;
+	}
+
+	for (uint32_t n = 0; n < n_ir; ++n) {
+		memset (ir[n], 0, (sweep_len + irrec_len) * sizeof (float));
+	}
+}
+
+/* append a port group, its ports and IR channels follow the previous group */
+void
+IrCapture::Impl::add_group (uint32_t n_in, uint32_t n_out, uint32_t n_ch)
+{
+	PortGroup grp;
+	memset (&grp, 0, sizeof (grp));
+	if (!groups.empty ()) {
+		PortGroup const& prev = groups.back ();
+		grp.in0  = prev.in0 + prev.n_in;
+		grp.out0 = prev.out0 + prev.n_out;
+		grp.c0   = prev.c0 + prev.n_ch;
+	}
+	grp.n_in      = n_in;
+	grp.n_out     = n_out;
+	grp.n_ch      = n_ch;
+	grp.clip_chan = -1;
+	groups.push_back (grp);
+	ch_group.resize (grp.c0 + n_ch, groups.size () - 1);
+}
+
+/* queue bank-select (if needed) and program-change, wait until sent */
+int
+IrCapture::Impl::send_program (int program, int chn, bool bank)
+{
+	uint32_t n = 0;
+	if (bank) {
+		midi_ev[n][0] = 0xb0 | chn;
+		midi_ev[n][1] = 0x00;
+		midi_ev[n][2] = (program >> 7) & 0x7f;
+		midi_len[n++] = 3;
+		midi_ev[n][0] = 0xb0 | chn;
+		midi_ev[n][1] = 0x20;
+		midi_ev[n][2] = 0;
+		midi_len[n++] = 3;
+	}
+	midi_ev[n][0] = 0xc0 | chn;
+	midi_ev[n][1] = program & 0x7f;
+	midi_len[n++] = 2;
+
+	__atomic_store_n (&midi_n, n, __ATOMIC_RELEASE);
+	while (__atomic_load_n (&midi_n, __ATOMIC_ACQUIRE) > 0 && !interrupted ()) {
+		usleep (1000);
+	}
+	return interrupted () ? -1 : 0;
+}
+
+/* engage or release freewheeling, and wait for the engine to follow */
+int
+IrCapture::Impl::set_freewheel (bool onoff)
+{
+	if (backend->freewheel (onoff)) {
+		fprintf (stderr, "Cannot %s freewheel mode\n", onoff ? "start" : "stop");
+		return -1;
+	}
+	for (int i = 0; i < 100 && freewheeling != onoff; ++i) {
+		usleep (10000);
+	}
+	return freewheeling == onoff ? 0 : -1;
+}
+
+/* hand the stages timed so far to a capture */
+void
+IrCapture::Impl::stage_take (StageTime* t)
+{
+	memcpy (t, stage_time, sizeof (stage_time));
+	memset (stage_time, 0, sizeof (stage_time));
+}
+
+/* allocate a capture buffer-set, consecutive captures alternate sets */
+int
+IrCapture::Impl::alloc_buffers (uint32_t n_ch)
+{
+	for (uint32_t n = 0; n < n_ch; ++n) {
+		if (!ir[n] && !(ir[n] = (float*)calloc (sweep_len + irrec_max, sizeof (float)))) {
+			return -1;
+		}
+		if (cfg.pipeline && !ir_alt[n] && !(ir_alt[n] = (float*)calloc (sweep_len + irrec_max, sizeof (float)))) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+IrCapture::Impl::open ()
+{
+	stage_begin (&stage_time[ST_SETUP]);
+
+	true_stereo = cfg.true_stereo;
+	mls_order   = cfg.mls_order;
+	mls_periods = std::min<uint32_t> (64, std::max<uint32_t> (1, cfg.mls_periods));
+
+	/* the primary ports are the first group, all groups share the session */
+	std::vector<IrPortGroup> pg (1);
+	pg[0].capture  = cfg.capture;
+	pg[0].playback = cfg.playback;
+	pg.insert (pg.end (), cfg.groups.begin (), cfg.groups.end ());
+
+	if (pg.size () > max_groups) {
+		fprintf (stderr, "Too many port groups, at most %u\n", max_groups);
+		return -1;
+	}
+
+	std::vector<std::string> capt;
+	std::vector<std::string> play;
+	for (uint32_t g = 0; g < pg.size (); ++g) {
+		const uint32_t n_in  = pg[g].capture.size ();
+		const uint32_t n_out = pg[g].playback.size ();
+		if (n_out < 1 || n_out > 2 || n_in < 1 || n_in > 2 || n_out > n_in) {
+			fprintf (stderr, "Invalid number of i/o ports\n");
+			return -1;
+		}
+		add_group (n_in, n_out, true_stereo ? 4 : n_in);
+		capt.insert (capt.end (), pg[g].capture.begin (), pg[g].capture.end ());
+		play.insert (play.end (), pg[g].playback.begin (), pg[g].playback.end ());
+	}
+
+	n_inputs  = capt.size ();
+	n_outputs = play.size ();
+
+	if (groups.size () > 1 && (true_stereo || mls_order > 0 || cfg.headroom >= 0 || cfg.adaptive)) {
+		fprintf (stderr, "Port groups are only supported with a plain sine-sweep\n");
+		return -1;
+	}
+
+	if (true_stereo && (n_outputs != 2 || n_inputs != 2)) {
+		fprintf (stderr, "True-Stereo needs stereo I/O\n");
+		return -1;
+	}
+
+	if (mls_order > 0 && (mls_order < 10 || mls_order > 20)) {
+		fprintf (stderr, "MLS order is out of bounds 10 <= order <= 20\n");
+		return -1;
+	}
+
+	n_ir     = true_stereo ? 4 : n_inputs;
+	n_ir_max = std::max<uint32_t> (4, n_ir);
+
+	if (lib_acquire ()) {
+		fprintf (stderr, "Cannot start writer thread\n");
+		return -1;
+	}
+	lib_ref = true;
+
+	if (!cfg.sim.empty ()) {
+		sim     = new SimBackend (this);
+		backend = sim;
+	} else {
+		backend = new JackBackend (this);
+	}
+
+	if (backend->open (cfg)) {
+		return -1;
+	}
+	rate = backend->rate ();
+
+	/* hardware is not serviced while freewheeling */
+	for (size_t n = 0; cfg.freewheel && n < capt.size () + play.size (); ++n) {
+		std::string const& name = n < capt.size () ? capt[n] : play[n - capt.size ()];
+		if (backend->physical (name)) {
+			fprintf (stderr, "Freewheel mode cannot use physical port '%s'\n", name.c_str ());
+			return -1;
+		}
+	}
+
+	if (rate < 44100 || rate > 96000) {
+		fprintf (stderr, "Invalid sample-rate, not (44100 <= rate <= 96000)\n");
+		return -1;
+	}
+
+	if (true_stereo) {
+		true_stereo_pass = rate * cfg.t_silence;
+	}
+
+	if (cfg.adaptive) {
+		decay_len = rate / 4;
+	}
+
+	if (mls_order > 0) {
+		/* capture a single averaged period, the sweep is not used */
+		if (mls_setup (mls_order)) {
+			fprintf (stderr, "Out of Memory\n");
+			return -1;
+		}
+		irrec_len = mls_len;
+	} else {
+		/* prepare sweep */
+		irrec_len = cfg.irrec_sec * rate;
+		sweep_len = gensweep (cfg.sweep_min, cfg.sweep_max, cfg.sweep_sec, rate, cfg.sweep_amp);
+	}
+	irrec_max = irrec_len;
+
+#if 0 // Debug Dump sweep
+	{
+		float* sd[2] = { sweep_sin, sweep_inv };
+		sf_write ("/tmp/ir_sweep.wav", 2, rate, 0, sweep_len, sd);
+	}
+#endif
+
+	ir     = (float**)calloc (n_ir_max, sizeof (float*));
+	ir_alt = (float**)calloc (n_ir_max, sizeof (float*));
+
+	if (!ir || !ir_alt) {
+		fprintf (stderr, "Out of Memory\n");
+		return -1;
+	}
+
+	if (backend->add_ports (n_inputs, n_outputs, cfg.midi)) {
+		return -1;
+	}
+	n_play    = n_outputs;
+	n_port_in = n_inputs;
+
+	if (alloc_buffers (n_ir)) {
+		fprintf (stderr, "Out of Memory\n");
+		return -1;
+	}
+
+#if 0 // DEBUG test convolv
+	for (uint32_t n = 0; n < n_ir; ++n) {
+		memcpy (ir[n], sweep_sin, sweep_len * sizeof (float));
+	}
+	if (deconv.configure (n_ir, sweep_inv, sweep_len, sweep_gen) || deconv.process (sweep_len + irrec_len, ir)) { return -1; }
+	return sf_write ("/tmp/ir_conv.wav", n_ir, rate, 0, sweep_len + irrec_len, ir);
+#endif
+
+	if (backend->start ()) {
+		return -1;
+	}
+	latency_update ();
+
+	/* connect ports */
+	for (uint32_t n = 0; n < n_outputs; ++n) {
+		if (!play[n].empty ()) {
+			backend->connect_playback (n, play[n]);
+		}
+	}
+
+	for (uint32_t n = 0; n < n_inputs; ++n) {
+		if (!capt[n].empty ()) {
+			backend->connect_capture (n, capt[n]);
+		}
+	}
+
+	if (!cfg.midi_connect.empty ()) {
+		backend->connect_midi (cfg.midi_connect);
+	}
+
+	backend->settle (1000000);
+
+	if (post_start ()) {
+		fprintf (stderr, "Cannot start post-processing thread\n");
+		return -1;
+	}
+	stage_end (&stage_time[ST_SETUP]);
+	return 0;
+}
+
+/* stop the workers and release everything, also after a failed open() */
+void
+IrCapture::Impl::cleanup ()
+{
+	post_stop ();
+	if (lib_ref) {
+		write_wait (this);
+	}
+
+	if (backend) {
+		backend->stop ();
+		delete backend;
+		backend = NULL;
+		sim     = NULL;
+	}
+
+	free (sweep_sin);
+	free (sweep_inv);
+	free (mls_tag_s);
+	free (mls_tag_l);
+	free (mls_work);
+
+	free (live_buf[0]);
+	free (live_buf[1]);
+	if (live_plan) {
+		Convplan::release (live_plan);
+	}
+	fftwf_free (live_fft);
+	fftwf_free (live_frq);
+	if (live_shm) {
+		munmap (live_shm, live_shm_sz);
+	}
+
+	for (uint32_t n = 0; ir && n < n_ir_max; ++n) {
+		free (ir[n]);
+	}
+	for (uint32_t n = 0; ir_alt && n < n_ir_max; ++n) {
+		free (ir_alt[n]);
+	}
+	free (ir);
+	free (ir_alt);
+
+	deconv.cleanup ();
+
+	if (lib_ref) {
+		lib_release ();
+		lib_ref = false;
+	}
+}
+
+int
+IrCapture::Impl::connect (std::vector<std::string> const& capt, std::vector<std::string> const& play, bool ts)
+{
+	if (!cfg.groups.empty ()) {
+		fprintf (stderr, "Ports cannot be re-connected with port groups\n");
+		return -1;
+	}
+	if (play.size () < 1 || play.size () > n_play || capt.size () < 1 || capt.size () > n_port_in || play.size () > capt.size ()) {
+		fprintf (stderr, "Invalid number of i/o ports\n");
+		return -1;
+	}
+	if (ts && (play.size () != 2 || capt.size () != 2)) {
+		fprintf (stderr, "True-Stereo needs stereo I/O\n");
+		return -1;
+	}
+	if (ts && mls_order > 0) {
+		fprintf (stderr, "MLS excitation does not support True-Stereo\n");
+		return -1;
+	}
+
+	n_inputs         = capt.size ();
+	n_outputs        = play.size ();
+	true_stereo      = ts;
+	true_stereo_pass = ts ? rate * cfg.t_silence : 1;
+	n_ir             = ts ? 4 : n_inputs;
+
+	groups.clear ();
+	ch_group.clear ();
+	add_group (n_inputs, n_outputs, n_ir);
+
+	if (alloc_buffers (n_ir)) {
+		fprintf (stderr, "Out of Memory\n");
+		return -1;
+	}
+
+	for (uint32_t n = 0; n < n_outputs; ++n) {
+		if (backend->connect_playback (n, play[n])) {
+			fprintf (stderr, "Cannot connect '%s'\n", play[n].c_str ());
+			disconnect ();
+			return -1;
+		}
+	}
+	for (uint32_t n = 0; n < n_inputs; ++n) {
+		if (backend->connect_capture (n, capt[n])) {
+			fprintf (stderr, "Cannot connect '%s'\n", capt[n].c_str ());
+			disconnect ();
+			return -1;
+		}
+	}
+
+	/* allow the graph-order callback to update the latency */
+	backend->settle (100000);
+	latency_update ();
+	return 0;
+}
+
+void
+IrCapture::Impl::disconnect ()
+{
+	backend->disconnect ();
+}
+
+int
+IrCapture::Impl::capture (std::vector<std::string> const& outfile, std::string const& rawfile, int latency, void* user)
+{
+	if (!post_active || interrupted ()) {
+		return -1;
+	}
+	if (outfile.size () != groups.size ()) {
+		fprintf (stderr, "Expected %u IR files, one per port group\n", (uint32_t)groups.size ());
+		return -1;
+	}
+	if (latency <= 0) {
+		latency = cfg.latency;
+	}
+
+	if (!cfg.pipeline) {
+		/* a single buffer-set, the previous capture must be done */
+		post_wait ();
+	}
+
+	if (cfg.headroom >= 0 && mls_order == 0) {
+		/* the sweep is replaced, the previous capture must be done */
+		post_wait ();
+		const double cpu = proc_cpu;
+		stage_begin (&stage_time[ST_PROBE]);
+		float amp = run_probe (cfg.sweep_min, cfg.sweep_max, cfg.sweep_sec, rate, cfg.headroom, cfg.quiet);
+		stage_end (&stage_time[ST_PROBE]);
+		stage_time[ST_PROBE].cpu += proc_cpu - cpu;
+		if (amp < 0) {
+			return -1;
+		}
+	}
+
+	uint32_t n_max = irrec_max;
+	if (mls_order > 0) {
+		n_max = (1 + mls_periods) * mls_len;
+	} else if (true_stereo) {
+		n_max += irrec_max + rate * cfg.t_silence;
+	}
+
+	capture_reset (irrec_max, true_stereo ? rate * cfg.t_silence : 1);
+	if (sim) {
+		sim->stats_reset ();
+	}
+
+	const double cpu = proc_cpu;
+	stage_begin (&stage_time[ST_CAPTURE]);
+
+	if (cfg.freewheel && set_freewheel (true)) {
+		stage_end (&stage_time[ST_CAPTURE]);
+		return -1;
+	}
+	client_state = Run;
+	if (interrupted ()) {
+		client_state = Abort;
+	}
+
+	/* a freewheeling engine spins idle until released, poll more often */
+	for (int i = 1; client_state == Run; ++i) {
+		usleep (cfg.freewheel ? 10000 : 50000);
+		capture_poll (rate, latency, !rawfile.empty ());
+		if (progress_cb && i % (cfg.freewheel ? 100 : 20) == 0) {
+			progress_cb (progress_arg, std::min (100.f, 100.f * proc_tot / n_max), proc_pos < sweep_len ? 'P' : 'C');
+		}
+	}
+	if (cfg.freewheel && set_freewheel (false)) {
+		post_failed = true;
+	}
+	stage_end (&stage_time[ST_CAPTURE]);
+	stage_time[ST_CAPTURE].cpu += proc_cpu - cpu;
+	if (sim) {
+		sim->stats_print (cfg.quiet);
+	}
+
+	PostJob* pj = &post_jobs[n_capture++ % 2];
+	post_prepare (pj, rate, latency, outfile, rawfile, cfg.quiet);
+	stage_take (pj->t);
+	pj->user = user;
+	post_submit (pj);
+	if (cfg.pipeline) {
+		std::swap (ir, ir_alt);
+	}
+
+	/* clipping is reported with the result, x-runs and interrupts end a batch */
+	const bool aborted = client_state == Abort && clip_chan < 0;
+	client_state       = Exit;
+	return aborted ? 1 : 0;
+}
+
+void*
+IrCapture::Impl::live_worker ()
+{
+	pthread_mutex_lock (&live_lock);
+	while (client_state == Run) {
+		struct timespec ts;
+		clock_gettime (CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000; /* 100ms, in case a signal was missed */
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+		pthread_cond_timedwait (&live_cond, &live_lock, &ts);
+
+		int b = __atomic_load_n (&live_pend, __ATOMIC_ACQUIRE);
+		if (b < 0) {
+			continue;
+		}
+		pthread_mutex_unlock (&live_lock);
+		live_update (live_buf[b]);
+		__atomic_store_n (&live_pend, -1, __ATOMIC_RELEASE);
+		pthread_mutex_lock (&live_lock);
+	}
+	pthread_mutex_unlock (&live_lock);
+	return NULL;
+}
+
+static void*
+live_worker (void* arg)
+{
+	return ((IrCapture::Impl*)arg)->live_worker ();
+}
+
+int
+IrCapture::Impl::live (std::string const& fn)
+{
+	pthread_t live_thread;
+
+	if (!post_active || interrupted () || mls_order == 0 || live_shm) {
+		return -1;
+	}
+
+	if (live_setup (fn.c_str (), rate)) {
+		fprintf (stderr, "Cannot setup live monitoring\n");
+		return -1;
+	}
+
+	capture_reset (irrec_max, 1);
+	live_lat     = ir_latency (cfg.latency);
+	live_mode    = true;
+	client_state = Run;
+	if (pthread_create (&live_thread, NULL, ::live_worker, this)) {
+		fprintf (stderr, "Cannot start live worker\n");
+		client_state = Abort;
+		live_mode    = false;
+		return -1;
+	}
+	if (interrupted ()) {
+		client_state = Abort;
+	}
+	while (client_state == Run) {
+		sleep (1);
+		if (!cfg.quiet) {
+			printf ("Live: %u updates, %u dropped, peak: %.2fdBFS \r",
+			        live_shm->n_updates, live_drop, 20 * log10f (live_peak));
+			fflush (stdout);
+		}
+	}
+	if (!cfg.quiet) {
+		printf ("\n");
+	}
+	pthread_join (live_thread, NULL);
+	live_mode = false;
+	return 0;
+}
+
+bool
+IrCapture::Impl::finish ()
+{
+	post_wait ();
+	write_wait (this);
+	return !(post_failed || write_failed);
+}
+
+IrConfig::IrConfig ()
+	: client_name ("ir")
+	, true_stereo (false)
+	, sweep_min (20.f)
+	, sweep_max (20000.f)
+	, sweep_sec (10.f)
+	, sweep_amp (.5f)
+	, irrec_sec (15.f)
+	, t_silence (1.f)
+	, headroom (-1)
+	, adaptive (false)
+	, mls_order (0)
+	, mls_periods (4)
+	, latency (0)
+	, freewheel (false)
+	, xrun_abort (true)
+	, midi (false)
+	, pipeline (false)
+	, timing (false)
+	, quiet (false)
+{
+}
+
+IrCapture::IrCapture ()
+	: _impl (new Impl ())
+	, _interrupt (0)
+{
+	_impl->user_interrupt = &_interrupt;
+}
+
+IrCapture::~IrCapture ()
+{
+	_impl->cleanup ();
+	delete _impl;
+}
+
+void
+IrCapture::set_progress_callback (ProgressCallback cb, void* arg)
+{
+	_impl->progress_cb  = cb;
+	_impl->progress_arg = arg;
+}
+
+void
+IrCapture::set_result_callback (ResultCallback cb, void* arg)
+{
+	_impl->result_cb  = cb;
+	_impl->result_arg = arg;
+}
+
+int
+IrCapture::open (IrConfig const& cfg)
+{
+	close ();
+	_interrupt = 0;
+	_impl->cfg = cfg;
+	if (_impl->open ()) {
+		close ();
+		return -1;
+	}
+	return 0;
+}
+
+/* the session can be opened again, callbacks are retained */
+void
+IrCapture::close ()
+{
+	Impl* s           = new Impl ();
+	s->user_interrupt = &_interrupt;
+	s->progress_cb    = _impl->progress_cb;
+	s->progress_arg   = _impl->progress_arg;
+	s->result_cb      = _impl->result_cb;
+	s->result_arg     = _impl->result_arg;
+
+	_impl->cleanup ();
+	delete _impl;
+	_impl = s;
+}
+
+uint32_t
+IrCapture::rate () const
+{
+	return _impl->rate;
+}
+
+uint32_t
+IrCapture::roundtrip_latency () const
+{
+	return _impl->roundtrip_latency;
+}
+
+int
+IrCapture::connect (std::vector<std::string> const& capt, std::vector<std::string> const& play, bool true_stereo)
+{
+	return _impl->connect (capt, play, true_stereo);
+}
+
+void
+IrCapture::disconnect ()
+{
+	_impl->disconnect ();
+}
+
+int
+IrCapture::send_program (int program, int chn, bool bank, float settle)
+{
+	if (!_impl->backend || !_impl->backend->midi ()) {
+		return -1;
+	}
+	stage_begin (&_impl->stage_time[ST_SETTLE]);
+	int rv = _impl->send_program (program, chn, bank);
+	if (!rv) {
+		usleep (settle * 1e6);
+	}
+	stage_end (&_impl->stage_time[ST_SETTLE]);
+	return rv || _impl->interrupted () ? -1 : 0;
+}
+
+int
+IrCapture::capture (std::string const& outfile, std::string const& rawfile, int latency, void* user)
+{
+	return _impl->capture (std::vector<std::string> (1, outfile), rawfile, latency, user);
+}
+
+int
+IrCapture::capture_groups (std::vector<std::string> const& outfiles, std::string const& rawfile, int latency, void* user)
+{
+	return _impl->capture (outfiles, rawfile, latency, user);
+}
+
+uint32_t
+IrCapture::n_groups () const
+{
+	return _impl->groups.size ();
+}
+
+int
+IrCapture::live (std::string const& fn)
+{
+	return _impl->live (fn);
+}
+
+bool
+IrCapture::finish ()
+{
+	return _impl->finish ();
+}
+
+void
+IrCapture::interrupt ()
+{
+	_interrupt = 1;
+}
+
+bool
+IrCapture::interrupted () const
+{
+	return _impl->interrupted ();
+}
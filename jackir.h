@@ -0,0 +1,196 @@
+/* libjackir - JACK Impulse Response Capture
+ *
+ * Copyright (C) 2019 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _JACKIR_H_
+#define _JACKIR_H_
+
+#include <signal.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* stages of a capture, see CaptureResult::t */
+enum Stage {
+	ST_SETUP = 0,
+	ST_SETTLE,
+	ST_PROBE,
+	ST_CAPTURE,
+	ST_DECONV,
+	ST_NORMALIZE,
+	ST_TRIM,
+	ST_WRITE,
+	N_STAGES
+};
+
+extern const char* const stage_name[N_STAGES];
+
+struct StageTime {
+	double wall;
+	double cpu; /* of the thread(s) that ran the stage */
+};
+
+struct CaptureResult {
+	const char* error;      /* NULL on success */
+	float       peak;       /* input peak */
+	float       gain;       /* normalization gain */
+	int         latency;    /* alignment used */
+	int         latency_rt; /* reported round-trip latency */
+	int         latency_ir; /* measured, position of the IR peak */
+	uint32_t    n_channels;
+	uint32_t    ir_len;
+	float       noise;      /* IR noise floor (RMS), 0: unknown */
+	float       snr;        /* IR peak to noise energy, 0: unknown */
+	float       in_noise;   /* input noise floor, if probed */
+	StageTime   t[N_STAGES];
+};
+
+/* A device under test: 1 or 2 capture and playback ports */
+struct IrPortGroup {
+	std::vector<std::string> capture;
+	std::vector<std::string> playback;
+};
+
+/* Session parameters, fixed once the session is opened.
+ * The number of capture and playback entries sets the number of ports
+ * (1 or 2 each), a port is connected unless its name is empty.
+ */
+struct IrConfig {
+	IrConfig ();
+
+	std::string              client_name;  /* JACK client name */
+	std::string              sim;          /* simulate a device instead of using JACK, see below */
+	std::vector<std::string> capture;
+	std::vector<std::string> playback;
+
+	/* further devices, measured by the same sine-sweep in the same cycles
+	 * (no true-stereo, MLS, auto-gain or adaptive). Each group is
+	 * post-processed separately, and written to a file of its own. */
+	std::vector<IrPortGroup> groups;
+
+	bool     true_stereo;
+	float    sweep_min;    /* Hz */
+	float    sweep_max;    /* Hz */
+	float    sweep_sec;    /* without fades */
+	float    sweep_amp;
+	float    irrec_sec;    /* max capture length */
+	float    t_silence;    /* between true-stereo passes */
+	float    headroom;     /* dB, probe and set the sweep level, < 0: off */
+	bool     adaptive;     /* end the capture once the response decayed */
+	uint32_t mls_order;    /* use MLS excitation, 0: sine-sweep */
+	uint32_t mls_periods;
+	int      latency;      /* alignment, 0: use the round-trip latency */
+
+	bool        freewheel;    /* run JACK in freewheel mode during captures */
+	bool        xrun_abort;
+	bool        midi;         /* register a MIDI output for program changes */
+	std::string midi_connect;
+	bool        pipeline;     /* post-process while the next capture records */
+	bool        timing;       /* measure the CPU time of the process callback */
+	bool        quiet;        /* inhibit non-error messages */
+};
+
+/* A capture session: one set of ports, buffers and worker threads.
+ * Several sessions may run concurrently, each with its own JACK client.
+ * Output files are written by a writer thread that is shared by all
+ * sessions of the process.
+ *
+ * IrConfig::sim is "default" or a comma separated list of rate=<Hz>,
+ * period=<spl>, delay=<spl>, gain=<dB>, noise=<dBFS>, drive=<tanh gain>,
+ * rt60=<sec> or ir=<file>. The sweep is then routed through a known IR,
+ * faster than realtime. With max-error=<dB> (< 0) or max-align=<spl>
+ * post-processing fails if the recovered IR deviates more.
+ */
+class IrCapture
+{
+public:
+	/* called periodically by capture(), progress in percent,
+	 * phase 'P' while the sweep is playing, 'C' capturing the tail */
+	typedef void (*ProgressCallback) (void* arg, float progress, char phase);
+
+	/* called once per capture that was handed to post-processing, after
+	 * the IR has been written, or if post-processing failed (res->error).
+	 * This is called from a worker thread.
+	 */
+	typedef void (*ResultCallback) (void* arg, void* user, const char* file, CaptureResult const* res, uint32_t rate);
+
+	IrCapture ();
+	~IrCapture ();
+
+	void set_progress_callback (ProgressCallback cb, void* arg);
+	void set_result_callback (ResultCallback cb, void* arg);
+
+	/* open the client (or simulation), register ports, prepare the
+	 * excitation and start the worker threads */
+	int  open (IrConfig const& cfg);
+	void close ();
+
+	uint32_t rate () const;
+	uint32_t roundtrip_latency () const;
+
+	/* (re)connect the ports for the following captures, the number of
+	 * ports used must not exceed the session's */
+	int  connect (std::vector<std::string> const& capt, std::vector<std::string> const& play, bool true_stereo);
+	void disconnect ();
+
+	/* send a MIDI program (with bank-select if bank is set) and wait
+	 * for the device to settle */
+	int send_program (int program, int chn, bool bank, float settle);
+
+	/* Capture an IR. This blocks until the capture is complete, the IR
+	 * is post-processed and written in the background and reported to
+	 * the result callback along with user. Returns -1 if the capture
+	 * could not be run, no result is reported then, and 1 if it was
+	 * aborted by an x-run or interrupt (the batch should end).
+	 * latency overrides the session's alignment if > 0
+	 */
+	int capture (std::string const& outfile, std::string const& rawfile = "", int latency = 0, void* user = NULL);
+
+	/* capture all port groups at once, one IR file per group (in order,
+	 * the first one being IrConfig::capture, playback). The result
+	 * callback is called for each group, the raw file has all channels.
+	 */
+	int capture_groups (std::vector<std::string> const& outfiles, std::string const& rawfile = "", int latency = 0, void* user = NULL);
+
+	uint32_t n_groups () const;
+
+	/* continuously capture periodic MLS and publish each IR to a shared
+	 * memory map, until interrupted */
+	int live (std::string const& fn);
+
+	/* wait until all captures are post-processed and written,
+	 * returns false if any of them failed */
+	bool finish ();
+
+	/* abort the current capture and all following ones, until the
+	 * session is opened again. This is async-signal-safe, also while
+	 * the session is being opened or closed */
+	void interrupt ();
+	bool interrupted () const;
+
+	struct Impl;
+
+private:
+	IrCapture (IrCapture const&);
+	IrCapture& operator= (IrCapture const&);
+
+	Impl*                 _impl;
+	volatile sig_atomic_t _interrupt; /* survives close () */
+};
+
+#endif
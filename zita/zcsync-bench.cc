@@ -0,0 +1,198 @@
+/* zcsync-bench - level thread trigger micro-benchmark
+ *
+ * Copyright (C) 2019 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Compares ZCsema and ZCfutex:
+ *  - trigger-to-wake latency: post() to a sleeping waiter, until it runs
+ *  - round-trip: trigger a thread and wait for it, as Convlevel does
+ *  - uncontended post() + trywait()
+ * and the per-cycle cost of Convproc::process() with the compiled-in
+ * ZCsync (build with -DZCSYNC_USE_SEMA to compare).
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "zita-convolver.h"
+
+using namespace IrJackZitaConvolver;
+
+static double
+now_sec ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void
+print_stats (const char* name, const char* what, std::vector<double>& t)
+{
+	std::sort (t.begin (), t.end ());
+	const size_t n = t.size ();
+	printf ("%-8s %-12s median: %7.2f us, p99: %7.2f us, max: %8.2f us\n", name, what,
+	        1e6 * t[n / 2], 1e6 * t[n * 99 / 100], 1e6 * t[n - 1]);
+}
+
+template <class S>
+struct PingPong {
+	S               trig;
+	S               done;
+	volatile double t_post;
+	volatile double t_wake;
+	volatile bool   quit;
+};
+
+template <class S>
+static void*
+pong (void* arg)
+{
+	PingPong<S>* p = (PingPong<S>*)arg;
+	while (true) {
+		p->trig.wait ();
+		p->t_wake = now_sec ();
+		if (p->quit) {
+			break;
+		}
+		p->done.post ();
+	}
+	return NULL;
+}
+
+template <class S>
+static int
+bench_sync (const char* name, int n_iter)
+{
+	PingPong<S> p;
+	pthread_t   thread;
+	p.quit = false;
+
+	if (pthread_create (&thread, NULL, pong<S>, &p)) {
+		fprintf (stderr, "Cannot start thread\n");
+		return -1;
+	}
+
+	std::vector<double> wake;
+	std::vector<double> rtrip;
+	for (int i = 0; i < n_iter; ++i) {
+		/* let the waiter go to sleep, beyond any spinning */
+		usleep (50);
+		double t0 = now_sec ();
+		p.trig.post ();
+		p.done.wait ();
+		double t1 = now_sec ();
+		wake.push_back (p.t_wake - t0);
+		rtrip.push_back (t1 - t0);
+	}
+
+	p.quit = true;
+	p.trig.post ();
+	pthread_join (thread, NULL);
+
+	/* back-to-back, the waiter may still be spinning */
+	std::vector<double> busy;
+	S                   s;
+	for (int i = 0; i < n_iter; ++i) {
+		double t0 = now_sec ();
+		for (int k = 0; k < 100; ++k) {
+			s.post ();
+			s.trywait ();
+		}
+		busy.push_back ((now_sec () - t0) / 100);
+	}
+
+	print_stats (name, "wake", wake);
+	print_stats (name, "round-trip", rtrip);
+	print_stats (name, "post+try", busy);
+	return 0;
+}
+
+/* a 2 sec mono IR, 256 spl periods: several level threads per cycle */
+static int
+bench_convproc (int n_cycles)
+{
+	const uint32_t rate   = 48000;
+	const uint32_t period = 256;
+	const uint32_t ir_len = 2 * rate;
+
+	float* ir = (float*)calloc (ir_len, sizeof (float));
+	for (uint32_t n = 0; n < ir_len; ++n) {
+		ir[n] = expf (-6.9078f * n / ir_len) * ((n * 2654435761u) / 4294967296.f - .5f);
+	}
+
+	Convproc conv;
+	if (conv.configure (1, 1, ir_len, period, period, Convproc::MAXPART, 0)
+	    || conv.impdata_create (0, 0, 1, ir, 0, ir_len)
+	    || conv.start_process (0, 0)) {
+		fprintf (stderr, "Cannot configure convolver\n");
+		free (ir);
+		return -1;
+	}
+
+	std::vector<double> cycle;
+	for (int i = 0; i < n_cycles; ++i) {
+		float* in = conv.inpdata (0);
+		for (uint32_t n = 0; n < period; ++n) {
+			in[n] = (n + i) % 64 == 0 ? 1.f : 0.f;
+		}
+		double t0 = now_sec ();
+		conv.process (true);
+		cycle.push_back (now_sec () - t0);
+	}
+
+	conv.stop_process ();
+	conv.cleanup ();
+	free (ir);
+
+#if defined(__linux__) && !defined(ZCSYNC_USE_SEMA)
+	print_stats ("ZCfutex", "Convproc", cycle);
+#else
+	print_stats ("ZCsema", "Convproc", cycle);
+#endif
+	return 0;
+}
+
+int
+main (int argc, char** argv)
+{
+	int n_iter = argc > 1 ? atoi (argv[1]) : 2000;
+	if (n_iter < 100) {
+		n_iter = 100;
+	}
+
+	if (bench_sync<ZCsema> ("ZCsema", n_iter)) {
+		return 1;
+	}
+#if defined(__linux__) && !defined(ZCSYNC_USE_SEMA)
+	if (bench_sync<ZCfutex> ("ZCfutex", n_iter)) {
+		return 1;
+	}
+#endif
+	if (bench_convproc (10 * n_iter)) {
+		return 1;
+	}
+	return 0;
+}
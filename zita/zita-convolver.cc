@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include "zita-convolver.h"
 
 using namespace IrJackZitaConvolver;
@@ -45,6 +46,24 @@ static fftwf_complex *calloc_complex (uint32_t k)
     return p;
 }
 
+static double timenow (void)
+{
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static uint64_t nsecs (void)
+{
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Statistics have one writer each, and are read by other threads.
+#define ST_LOAD(x) __atomic_load_n (&(x), __ATOMIC_RELAXED)
+#define ST_STORE(x, v) __atomic_store_n (&(x), (v), __ATOMIC_RELAXED)
+
 
 Convproc::Convproc (void) :
     _state (ST_IDLE),
@@ -56,11 +75,13 @@ Convproc::Convproc (void) :
     _minpart (0),
     _maxpart (0),
     _nlevels (0),
-    _latecnt (0)
+    _latecnt (0),
+    _exec (0)
 {
     memset (_inpbuff, 0, MAXINP * sizeof (float *));
     memset (_outbuff, 0, MAXOUT * sizeof (float *));
     memset (_convlev, 0, MAXLEV * sizeof (Convlevel *));
+    memset (_fftcost, 0, sizeof (_fftcost));
 }
 
 
@@ -83,6 +104,13 @@ void Convproc::set_skipcnt (uint32_t skipcnt)
 }
 
 
+void Convproc::set_executor (Convexec *exec)
+{
+    if (_state == ST_PROC) return;
+    _exec = exec;
+}
+
+
 int Convproc::configure (uint32_t  ninp,
                          uint32_t  nout,
                          uint32_t  maxsize,
@@ -112,7 +140,7 @@ int Convproc::configure (uint32_t  ninp,
     nmin = (ninp < nout) ? ninp : nout;
     if (density <= 0.0f) density = 1.0f / nmin;
     if (density >  1.0f) density = 1.0f;
-    cfft = _fft_cost * (ninp + nout);
+    cfft = fftcost (minpart) * (ninp + nout);
     cmac = _mac_cost * ninp * nout * density;
     step = (cfft < 4 * cmac) ? 1 : 2;
     if (step == 2)
@@ -136,6 +164,7 @@ int Convproc::configure (uint32_t  ninp,
 	for (offs = pind = 0; offs < maxsize; pind++)
 	{
 	    npar = (maxsize - offs + size - 1) / size;
+	    cfft = fftcost (size) * (ninp + nout);
 	    if ((size < maxpart) && (npar > nmin))
 	    {
 		r = 1 << s;
@@ -178,6 +207,87 @@ int Convproc::configure (uint32_t  ninp,
 }
 
 
+int Convproc::calibrate (uint32_t minpart, uint32_t maxpart)
+{
+    uint32_t        i, k, n, size;
+    double          tfft = 0, tmac = 0;
+    fftwf_complex   *A, *B;
+    Convlevel       *C;
+
+    if (_state != ST_IDLE) return Converror::BAD_STATE;
+    if (   (minpart & (minpart - 1))
+	|| (minpart < MINPART)
+        || (maxpart & (maxpart - 1))
+	|| (maxpart > MAXPART)
+	|| (maxpart < minpart)) return Converror::BAD_PARAM;
+
+    // Time one partition of FFT and MAC work at each size, using
+    // the same kernels and plan options the levels will use.
+    A = B = 0;
+    C = 0;
+    try
+    {
+	for (size = minpart; size <= maxpart; size <<= 1)
+	{
+	    C = new Convlevel ();
+	    C->configure (0, 0, 1, size, _options);
+	    A = calloc_complex (size + 1);
+	    B = calloc_complex (size + 1);
+	    n = (1 << 20) / size;
+	    if (n < 16) n = 16;
+	    // The first round only warms up the caches.
+	    for (i = 0; i <= n; i++)
+	    {
+		if (i == 1) tfft = timenow ();
+		fftwf_execute_dft_r2c (C->_plan_r2c, C->_time_data, C->_freq_data);
+		fftwf_execute_dft_c2r (C->_plan_c2r, C->_freq_data, C->_time_data);
+	    }
+	    tfft = timenow () - tfft;
+	    for (i = 0; i <= n; i++)
+	    {
+		if (i == 1) tmac = timenow ();
+		C->macpart (C->_freq_data, A, B);
+	    }
+	    tmac = timenow () - tmac;
+	    for (k = 0; (1U << k) < size; k++);
+	    if (tmac > 0) _fftcost [k] = _mac_cost * 0.5 * tfft / tmac;
+	    fftwf_free (A);
+	    fftwf_free (B);
+	    delete C;
+	    A = B = 0;
+	    C = 0;
+	}
+    }
+    catch (...)
+    {
+	fftwf_free (A);
+	fftwf_free (B);
+	delete C;
+	return Converror::MEM_ALLOC;
+    }
+    return 0;
+}
+
+
+float Convproc::fftcost (uint32_t size) const
+{
+    uint32_t k;
+
+    for (k = 0; (1U << k) < size; k++);
+    if ((k < NCOST) && (_fftcost [k] > 0)) return _fftcost [k];
+    return _fft_cost;
+}
+
+
+void Convproc::set_fftcost (uint32_t size, float cost)
+{
+    uint32_t k;
+
+    for (k = 0; (1U << k) < size; k++);
+    if (k < NCOST) _fftcost [k] = cost;
+}
+
+
 int Convproc::impdata_create (uint32_t  inp,
                               uint32_t  out,
                               int32_t   step,
@@ -205,6 +315,141 @@ int Convproc::impdata_create (uint32_t  inp,
 }
 
 
+// One partition of impulse data to be transformed by impdata_load().
+
+struct Loadtask
+{
+    Convlevel      *_conv;
+    fftwf_complex  *_fftb;
+    float          *_data;
+    int32_t         _i0;
+};
+
+
+struct Loadjob
+{
+    Loadtask       *_task;
+    uint32_t        _ntask;
+    uint32_t        _next;
+    uint32_t        _size;
+    int32_t         _step;
+    int32_t         _n;
+    int             _err;
+};
+
+
+int Convproc::impdata_load (uint32_t   nchan,
+                            uint32_t  *inp,
+                            uint32_t  *out,
+                            float     *data,
+                            int32_t    ind0,
+                            int32_t    ind1,
+                            uint32_t   nthr)
+{
+    uint32_t    c, i, j, k, m;
+    int32_t     i0, n;
+    Convlevel   *L;
+    Macnode     *M;
+    Loadjob     J;
+    pthread_t   *T;
+
+    if (_state != ST_STOP) return Converror::BAD_STATE;
+    if ((nchan < 1) || (ind1 <= ind0)) return Converror::BAD_PARAM;
+    for (c = 0; c < nchan; c++)
+    {
+	if ((inp [c] >= _ninp) || (out [c] >= _nout)) return Converror::BAD_PARAM;
+	for (i = 0; i < c; i++)
+	{
+	    if ((inp [i] == inp [c]) && (out [i] == out [c])) return Converror::BAD_PARAM;
+	}
+    }
+
+    // Create all nodes and partitions on this thread, then let the
+    // workers transform the partitions, each using its own buffers.
+    for (j = m = 0; j < _nlevels; j++) m += _convlev [j]->_npar;
+    J._task = 0;
+    J._ntask = 0;
+    J._next = 0;
+    J._size = _maxpart;
+    J._step = nchan;
+    J._n = n = ind1 - ind0;
+    J._err = 0;
+    T = 0;
+    try
+    {
+	J._task = new Loadtask [nchan * m];
+	for (c = 0; c < nchan; c++)
+	{
+	    for (j = 0; j < _nlevels; j++)
+	    {
+		L = _convlev [j];
+		M = L->impdata_alloc (inp [c], out [c], ind0, ind1);
+		if (M == 0) continue;
+		i0 = L->_offs - ind0;
+		for (k = 0; k < L->_npar; k++, i0 += L->_parsize)
+		{
+		    if ((i0 >= n) || (i0 + (int32_t) L->_parsize <= 0)) continue;
+		    Loadtask *X = J._task + J._ntask++;
+		    X->_conv = L;
+		    X->_fftb = M->_fftb [k];
+		    X->_data = data + c;
+		    X->_i0 = i0;
+		}
+	    }
+	}
+	if (nthr == 0) nthr = sysconf (_SC_NPROCESSORS_ONLN);
+	if (nthr > J._ntask) nthr = J._ntask;
+	if (nthr > 1) T = new pthread_t [nthr - 1];
+    }
+    catch (...)
+    {
+	delete[] J._task;
+	cleanup ();
+	return Converror::MEM_ALLOC;
+    }
+
+    for (i = m = 0; i + 1 < nthr; i++)
+    {
+	if (pthread_create (T + m, 0, static_load, &J) == 0) m++;
+    }
+    static_load (&J);
+    for (i = 0; i < m; i++) pthread_join (T [i], 0);
+    delete[] T;
+    delete[] J._task;
+    if (J._err)
+    {
+	cleanup ();
+	return J._err;
+    }
+    return 0;
+}
+
+
+void *Convproc::static_load (void *arg)
+{
+    uint32_t        i;
+    float           *prep;
+    fftwf_complex   *freq;
+    Loadjob         *J = (Loadjob *) arg;
+    Loadtask        *X;
+
+    prep = fftwf_alloc_real (2 * J->_size);
+    freq = fftwf_alloc_complex (J->_size + 1);
+    if (prep && freq)
+    {
+	while ((i = __atomic_fetch_add (&J->_next, 1, __ATOMIC_RELAXED)) < J->_ntask)
+	{
+	    X = J->_task + i;
+	    X->_conv->impdata_part (X->_fftb, X->_data, J->_step, X->_i0, J->_n, prep, freq);
+	}
+    }
+    else __atomic_store_n (&J->_err, (int) Converror::MEM_ALLOC, __ATOMIC_RELAXED);
+    fftwf_free (prep);
+    fftwf_free (freq);
+    return 0;
+}
+
+
 int Convproc::impdata_clear (uint32_t inp, uint32_t out)
 {
     uint32_t k;
@@ -285,7 +530,7 @@ int Convproc::start_process (int abspri, int policy)
 
     for (k = (_minpart == _quantum) ? 1 : 0; k < _nlevels; k++)
     {
-        _convlev [k]->start (abspri, policy);
+        _convlev [k]->start (abspri, policy, _exec);
     }
     _state = ST_PROC;
     return 0;
@@ -393,6 +638,289 @@ void Convproc::print (FILE *F)
 }
 
 
+int Convproc::stats (uint32_t lev, Convstats *S) const
+{
+    if (_state == ST_IDLE) return Converror::BAD_STATE;
+    if (lev >= _nlevels) return Converror::BAD_PARAM;
+    _convlev [lev]->stats (S);
+    return 0;
+}
+
+
+
+Convplan        *Convplan::_list = 0;
+pthread_mutex_t  Convplan::_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+Convplan::Convplan (uint32_t size, int flags) :
+    _next (0),
+    _size (size),
+    _flags (flags),
+    _refc (0),
+    _plan_r2c (0),
+    _plan_c2r (0)
+{
+    float          *t;
+    fftwf_complex  *f;
+
+    // Plan on scratch arrays, FFTW_MEASURE overwrites them.
+    t = calloc_real (size);
+    f = fftwf_alloc_complex (size / 2 + 1);
+    if (f)
+    {
+	_plan_r2c = fftwf_plan_dft_r2c_1d (size, t, f, flags);
+	_plan_c2r = fftwf_plan_dft_c2r_1d (size, f, t, flags);
+    }
+    fftwf_free (t);
+    fftwf_free (f);
+}
+
+
+Convplan::~Convplan (void)
+{
+    if (_plan_r2c) fftwf_destroy_plan (_plan_r2c);
+    if (_plan_c2r) fftwf_destroy_plan (_plan_c2r);
+}
+
+
+int Convplan::acquire (uint32_t size, int flags, fftwf_plan *plan_r2c, fftwf_plan *plan_c2r)
+{
+    Convplan  *P;
+    int       rv = 0;
+
+    pthread_mutex_lock (&_mutex);
+    for (P = _list; P && ((P->_size != size) || (P->_flags != flags)); P = P->_next);
+    if (! P)
+    {
+	try
+	{
+	    P = new Convplan (size, flags);
+	    if (P->_plan_r2c && P->_plan_c2r)
+	    {
+		P->_next = _list;
+		_list = P;
+	    }
+	    else
+	    {
+		delete P;
+		P = 0;
+	    }
+	}
+	catch (...)
+	{
+	    P = 0;
+	}
+    }
+    if (P)
+    {
+	P->_refc++;
+	*plan_r2c = P->_plan_r2c;
+	*plan_c2r = P->_plan_c2r;
+    }
+    else rv = Converror::MEM_ALLOC;
+    pthread_mutex_unlock (&_mutex);
+    return rv;
+}
+
+
+void Convplan::release (fftwf_plan plan_r2c)
+{
+    Convplan  *P;
+
+    pthread_mutex_lock (&_mutex);
+    for (P = _list; P && (P->_plan_r2c != plan_r2c); P = P->_next);
+    if (P && (P->_refc > 0)) P->_refc--;
+    pthread_mutex_unlock (&_mutex);
+}
+
+
+void Convplan::purge (void)
+{
+    Convplan  *P, **Q;
+
+    pthread_mutex_lock (&_mutex);
+    Q = &_list;
+    while ((P = *Q))
+    {
+	if (P->_refc == 0)
+	{
+	    *Q = P->_next;
+	    delete P;
+	}
+	else Q = &P->_next;
+    }
+    pthread_mutex_unlock (&_mutex);
+}
+
+
+class Convpool::Worker
+{
+public:
+
+    Worker (Convpool *pool) :
+	_next (0),
+	_pool (pool),
+	_pthr (0),
+	_busy (false),
+	_term (false),
+	_func (0),
+	_arg (0),
+	_prio (0),
+	_policy (0)
+    {}
+
+    Worker         *_next;
+    Convpool       *_pool;
+    pthread_t       _pthr;
+    bool            _busy;
+    bool            _term;
+    void         *(*_func)(void *);
+    void           *_arg;
+    int             _prio;
+    int             _policy;
+    ZCsync          _trig;
+};
+
+
+Convpool::Convpool (void) :
+    _list (0),
+    _nthr (0),
+    _policy (-1),
+    _abspri (0),
+    _setaff (false)
+{
+    pthread_mutex_init (&_mutex, 0);
+}
+
+
+Convpool::~Convpool (void)
+{
+    Worker  *W;
+
+    while (_list)
+    {
+	W = _list;
+	_list = W->_next;
+	W->_term = true;
+	W->_trig.post ();
+	pthread_join (W->_pthr, 0);
+	delete W;
+    }
+    pthread_mutex_destroy (&_mutex);
+}
+
+
+void Convpool::set_sched (int policy, int abspri)
+{
+    pthread_mutex_lock (&_mutex);
+    _policy = policy;
+    _abspri = abspri;
+    pthread_mutex_unlock (&_mutex);
+}
+
+
+int Convpool::set_affinity (uint32_t ncpu, const int *cpus)
+{
+#if defined(__linux__)
+    uint32_t  i;
+
+    pthread_mutex_lock (&_mutex);
+    CPU_ZERO (&_cpus);
+    for (i = 0; i < ncpu; i++)
+    {
+	if ((cpus [i] >= 0) && (cpus [i] < CPU_SETSIZE)) CPU_SET (cpus [i], &_cpus);
+    }
+    _setaff = (CPU_COUNT (&_cpus) > 0);
+    pthread_mutex_unlock (&_mutex);
+    return 0;
+#else
+    return (ncpu > 0) ? Converror::BAD_PARAM : 0;
+#endif
+}
+
+
+int Convpool::execute (void *(*func)(void *), void *arg, int prio, int abspri, int policy)
+{
+    int             min, max;
+    Worker          *W;
+    pthread_attr_t  attr;
+
+    pthread_mutex_lock (&_mutex);
+    if (_policy >= 0)
+    {
+	policy = _policy;
+	abspri = _abspri;
+    }
+    min = sched_get_priority_min (policy);
+    max = sched_get_priority_max (policy);
+    abspri += prio;
+    if (abspri > max) abspri = max;
+    if (abspri < min) abspri = min;
+
+    for (W = _list; W && W->_busy; W = W->_next);
+    if (! W)
+    {
+	try
+	{
+	    W = new Worker (this);
+	}
+	catch (...)
+	{
+	    pthread_mutex_unlock (&_mutex);
+	    return Converror::MEM_ALLOC;
+	}
+	pthread_attr_init (&attr);
+	pthread_attr_setstacksize (&attr, 0x10000);
+	if (pthread_create (&W->_pthr, &attr, static_main, W))
+	{
+	    pthread_attr_destroy (&attr);
+	    pthread_mutex_unlock (&_mutex);
+	    delete W;
+	    return Converror::MEM_ALLOC;
+	}
+	pthread_attr_destroy (&attr);
+	W->_next = _list;
+	_list = W;
+	_nthr++;
+    }
+    W->_busy = true;
+    W->_func = func;
+    W->_arg = arg;
+    W->_prio = abspri;
+    W->_policy = policy;
+    pthread_mutex_unlock (&_mutex);
+    W->_trig.post ();
+    return 0;
+}
+
+
+void *Convpool::static_main (void *arg)
+{
+    Worker              *W = (Worker *) arg;
+    Convpool            *P = W->_pool;
+    struct sched_param  parm;
+
+    while (true)
+    {
+	W->_trig.wait ();
+	if (W->_term) break;
+	pthread_mutex_lock (&P->_mutex);
+#if defined(__linux__)
+	if (P->_setaff) pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), &P->_cpus);
+#endif
+	pthread_mutex_unlock (&P->_mutex);
+	parm.sched_priority = W->_prio;
+	pthread_setschedparam (pthread_self (), W->_policy, &parm);
+	W->_func (W->_arg);
+	pthread_mutex_lock (&P->_mutex);
+	W->_func = 0;
+	W->_arg = 0;
+	W->_busy = false;
+	pthread_mutex_unlock (&P->_mutex);
+    }
+    return 0;
+}
+
 
 typedef float FV4 __attribute__ ((vector_size(16)));
 
@@ -409,8 +937,17 @@ Convlevel::Convlevel (void) :
     _plan_c2r (0),
     _time_data (0),
     _prep_data (0),
-    _freq_data (0)
+    _freq_data (0),
+    _mac_data (0),
+    _tc2r (0),
+    _st_ncycle (0),
+    _st_nlate (0),
+    _st_maxwait (0),
+    _st_tfft (0),
+    _st_tmac (0),
+    _st_tmax (0)
 {
+    memset (_st_hist, 0, sizeof (_st_hist));
 }
 
 
@@ -438,9 +975,8 @@ void Convlevel::configure (int       prio,
     _time_data = calloc_real (2 * _parsize);
     _prep_data = calloc_real (2 * _parsize);
     _freq_data = calloc_complex (_parsize + 1);
-    _plan_r2c = fftwf_plan_dft_r2c_1d (2 * _parsize, _time_data, _freq_data, fftwopt);
-    _plan_c2r = fftwf_plan_dft_c2r_1d (2 * _parsize, _freq_data, _time_data, fftwopt);
-    if (_plan_r2c && _plan_c2r) return;
+    _mac_data = calloc_complex (MACBATCH * (_parsize + 4));
+    if (Convplan::acquire (2 * _parsize, fftwopt, &_plan_r2c, &_plan_c2r) == 0) return;
     throw (Converror (Converror::MEM_ALLOC));
 }
 
@@ -454,8 +990,7 @@ void Convlevel::impdata_write (uint32_t  inp,
                                bool      create)
 {
     uint32_t        k;
-    int32_t         j, j0, j1, n;
-    float           norm;
+    int32_t         n;
     fftwf_complex   *fftb;
     Macnode         *M;
 
@@ -476,7 +1011,6 @@ void Convlevel::impdata_write (uint32_t  inp,
 	if (M == 0 || M->_link || M->_fftb == 0) return;
     }
     
-    norm = 0.5f / _parsize;
     for (k = 0; k < _npar; k++)
     {
 	i1 = i0 + _parsize;
@@ -487,28 +1021,72 @@ void Convlevel::impdata_write (uint32_t  inp,
             {
 		M->_fftb [k] = fftb = calloc_complex (_parsize + 1);
 	    }
-	    if (fftb && data)
-	    {
-	        memset (_prep_data, 0, 2 * _parsize * sizeof (float));
-	        j0 = (i0 < 0) ? 0 : i0;
-	        j1 = (i1 > n) ? n : i1;
-	        for (j = j0; j < j1; j++) _prep_data [j - i0] = norm * data [j * step];
-	        fftwf_execute_dft_r2c (_plan_r2c, _prep_data, _freq_data);
-#ifdef ENABLE_VECTOR_MODE
-	        if (_options & OPT_VECTOR_MODE) fftswap (_freq_data);
-#endif
-	        for (j = 0; j <= (int)_parsize; j++)
-	        {
-	            fftb [j][0] += _freq_data [j][0];
-	            fftb [j][1] += _freq_data [j][1];
-		}
-	    }
+	    if (fftb && data) impdata_part (fftb, data, step, i0, n, _prep_data, _freq_data);
 	}
 	i0 = i1;
     }
 }
 
 
+Macnode *Convlevel::impdata_alloc (uint32_t  inp,
+                                   uint32_t  out,
+                                   int32_t   i0,
+                                   int32_t   i1)
+{
+    uint32_t  k;
+    int32_t   n;
+    Macnode   *M;
+
+    n = i1 - i0;
+    i0 = _offs - i0;
+    i1 = i0 + _npar * _parsize;
+    if ((i0 >= n) || (i1 <= 0)) return 0;
+
+    M = findmacnode (inp, out, true);
+    if (M == 0 || M->_link) return 0;
+    if (M->_fftb == 0) M->alloc_fftb (_npar);
+    for (k = 0; k < _npar; k++)
+    {
+	i1 = i0 + _parsize;
+	if ((i0 < n) && (i1 > 0) && (M->_fftb [k] == 0))
+	{
+	    M->_fftb [k] = calloc_complex (_parsize + 1);
+	}
+	i0 = i1;
+    }
+    return M;
+}
+
+
+void Convlevel::impdata_part (fftwf_complex  *fftb,
+                              float          *data,
+                              int32_t         step,
+                              int32_t         i0,
+                              int32_t         n,
+                              float          *prep,
+                              fftwf_complex  *freq)
+{
+    int32_t  i1, j, j0, j1;
+    float    norm;
+
+    norm = 0.5f / _parsize;
+    i1 = i0 + _parsize;
+    memset (prep, 0, 2 * _parsize * sizeof (float));
+    j0 = (i0 < 0) ? 0 : i0;
+    j1 = (i1 > n) ? n : i1;
+    for (j = j0; j < j1; j++) prep [j - i0] = norm * data [j * step];
+    fftwf_execute_dft_r2c (_plan_r2c, prep, freq);
+#ifdef ENABLE_VECTOR_MODE
+    if (_options & OPT_VECTOR_MODE) fftswap (freq);
+#endif
+    for (j = 0; j <= (int)_parsize; j++)
+    {
+	fftb [j][0] += freq [j][0];
+	fftb [j][1] += freq [j][1];
+    }
+}
+
+
 void Convlevel::impdata_clear (uint32_t inp, uint32_t out)
 {
     uint32_t  i;
@@ -581,6 +1159,13 @@ void Convlevel::reset (uint32_t  inpsize,
     }
     _bits = _parsize / _outsize;
     _wait = 0;
+    _st_ncycle = 0;
+    _st_nlate = 0;
+    _st_maxwait = 0;
+    _st_tfft = 0;
+    _st_tmac = 0;
+    _st_tmax = 0;
+    memset (_st_hist, 0, sizeof (_st_hist));
     _ptind = 0;
     _opind = 0;
     _trig.init (0, 0);
@@ -588,13 +1173,20 @@ void Convlevel::reset (uint32_t  inpsize,
 }
 
 
-void Convlevel::start (int abspri, int policy)
+void Convlevel::start (int abspri, int policy, Convexec *exec)
 {
     int                min, max;
     pthread_attr_t     attr;
     struct sched_param parm;
 
+    // The level is marked as running here rather than by the thread,
+    // so that readout() never processes it inline once started.
     _pthr = 0;
+    if (exec)
+    {
+	if (exec->execute (static_main, this, _prio, abspri, policy) == 0) _stat = ST_PROC;
+	return;
+    }
     min = sched_get_priority_min (policy);
     max = sched_get_priority_max (policy);
     abspri += _prio;
@@ -608,7 +1200,7 @@ void Convlevel::start (int abspri, int policy)
     pthread_attr_setscope (&attr, PTHREAD_SCOPE_SYSTEM);
     pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
     pthread_attr_setstacksize (&attr, 0x10000);
-    pthread_create (&_pthr, &attr, static_main, this);
+    if (pthread_create (&_pthr, &attr, static_main, this) == 0) _stat = ST_PROC;
     pthread_attr_destroy (&attr);
 }
 
@@ -654,16 +1246,17 @@ void Convlevel::cleanup (void)
     }
     _out_list = 0;
 
-    fftwf_destroy_plan (_plan_r2c);
-    fftwf_destroy_plan (_plan_c2r);
+    if (_plan_r2c) Convplan::release (_plan_r2c);
     fftwf_free (_time_data);
     fftwf_free (_prep_data);
     fftwf_free (_freq_data);
+    fftwf_free (_mac_data);
     _plan_r2c = 0;
     _plan_c2r = 0;
     _time_data = 0;
     _prep_data = 0;
     _freq_data = 0;
+    _mac_data = 0;
 }
 
 
@@ -676,7 +1269,6 @@ void *Convlevel::static_main (void *arg)
 
 void Convlevel::main (void)
 {
-    _stat = ST_PROC;
     while (true)
     {
 	_trig.wait ();
@@ -694,7 +1286,8 @@ void Convlevel::main (void)
 
 void Convlevel::process (bool skip)
 {
-    uint32_t        i, i1, j, k, n1, n2, opi1, opi2;
+    uint32_t        i, i1, j, n, n1, n2, opi1, opi2;
+    uint64_t        t0, t1, t2;
     Inpnode         *X;
     Macnode         *M;
     Outnode         *Y;
@@ -703,6 +1296,10 @@ void Convlevel::process (bool skip)
     float           *inpd;
     float           *outd;
 
+    t0 = t1 = 0;
+    _tc2r = 0;
+    if (_options & OPT_LEVEL_STATS) t0 = nsecs ();
+
     i1 = _inpoffs;
     n1 = _parsize;
     n2 = 0;
@@ -728,6 +1325,7 @@ void Convlevel::process (bool skip)
 	if (_options & OPT_VECTOR_MODE) fftswap (X->_ffta [_ptind]);
 #endif
     }
+    if (_options & OPT_LEVEL_STATS) t1 = nsecs ();
 
     if (skip)
     {
@@ -739,8 +1337,15 @@ void Convlevel::process (bool skip)
     }
     else
     {
-	for (Y = _out_list; Y; Y = Y->_next)
+	Y = _out_list;
+	while (Y)
 	{
+	    n = findbatch (Y);
+	    if (n > 1)
+	    {
+		Y = macbatch (Y, n, opi1, opi2);
+		continue;
+	    }
 	    memset (_freq_data, 0, (_parsize + 1) * sizeof (fftwf_complex));
 	    for (M = Y->_list; M; M = M->_next)
 	    {
@@ -750,53 +1355,172 @@ void Convlevel::process (bool skip)
 		{
 		    ffta = X->_ffta [i];
 		    fftb = M->_link ? M->_link->_fftb [j] : M->_fftb [j];
-		    if (fftb)
-		    {
-#ifdef ENABLE_VECTOR_MODE
-			if (_options & OPT_VECTOR_MODE)
-			{
-			    FV4 *A = (FV4 *) ffta;
-			    FV4 *B = (FV4 *) fftb;
-			    FV4 *D = (FV4 *) _freq_data;
-			    for (k = 0; k < _parsize; k += 4)
-			    {
-				D [0] += A [0] * B [0] - A [1] * B [1];
-				D [1] += A [0] * B [1] + A [1] * B [0];
-				A += 2;
-				B += 2;
-				D += 2;
-			    }
-			    _freq_data [_parsize][0] += ffta [_parsize][0] * fftb [_parsize][0];
-			    _freq_data [_parsize][1] = 0;
-			}
-			else
-#endif
-			{
-			    for (k = 0; k <= _parsize; k++)
-			    {
-				_freq_data [k][0] += ffta [k][0] * fftb [k][0] - ffta [k][1] * fftb [k][1];
-				_freq_data [k][1] += ffta [k][0] * fftb [k][1] + ffta [k][1] * fftb [k][0];
-			    }
-			}
-		    }
+		    if (fftb) macpart (_freq_data, ffta, fftb);
 		    if (i == 0) i = _npar;
 		    i--;
 		}
 	    }
+	    outfft (Y, _freq_data, opi1, opi2);
+	    Y = Y->_next;
+	}
+    }
+
+    _ptind++;
+    if (_ptind == _npar) _ptind = 0;
+
+    if (_options & OPT_LEVEL_STATS)
+    {
+	t2 = nsecs ();
+	for (i = 0, n = (t2 - t0) / 1000; (n > 1) && (i < Convstats::NHIST - 1); i++, n >>= 1);
+	ST_STORE (_st_hist [i], _st_hist [i] + 1);
+	ST_STORE (_st_tfft, _st_tfft + (t1 - t0) + _tc2r);
+	ST_STORE (_st_tmac, _st_tmac + (t2 - t1) - _tc2r);
+	if (t2 - t0 > _st_tmax) ST_STORE (_st_tmax, t2 - t0);
+	ST_STORE (_st_ncycle, _st_ncycle + 1);
+    }
+}
+
+
+void Convlevel::macpart (fftwf_complex *D, fftwf_complex *A, fftwf_complex *B)
+{
+    uint32_t  k;
 
 #ifdef ENABLE_VECTOR_MODE
-	    if (_options & OPT_VECTOR_MODE) fftswap (_freq_data);
+    if (_options & OPT_VECTOR_MODE)
+    {
+	FV4 *P = (FV4 *) A;
+	FV4 *Q = (FV4 *) B;
+	FV4 *R = (FV4 *) D;
+	for (k = 0; k < _parsize; k += 4)
+	{
+	    R [0] += P [0] * Q [0] - P [1] * Q [1];
+	    R [1] += P [0] * Q [1] + P [1] * Q [0];
+	    P += 2;
+	    Q += 2;
+	    R += 2;
+	}
+	D [_parsize][0] += A [_parsize][0] * B [_parsize][0];
+	D [_parsize][1] = 0;
+	return;
+    }
 #endif
-	    fftwf_execute_dft_c2r (_plan_c2r, _freq_data, _time_data);
-	    outd = Y->_buff [opi1];
-	    for (k = 0; k < _parsize; k++) outd [k] += _time_data [k];
-	    outd = Y->_buff [opi2];
-	    memcpy (outd, _time_data + _parsize, _parsize * sizeof (float));
+    for (k = 0; k <= _parsize; k++)
+    {
+	D [k][0] += A [k][0] * B [k][0] - A [k][1] * B [k][1];
+	D [k][1] += A [k][0] * B [k][1] + A [k][1] * B [k][0];
+    }
+}
+
+
+uint32_t Convlevel::findbatch (Outnode *Y)
+{
+    uint32_t  n;
+    Macnode   *M, *S;
+
+    // Count the consecutive outputs, starting at Y, that each have a
+    // single input multiplied by the same (possibly linked) spectrum.
+    if (! _mac_data) return 1;
+    M = Y->_list;
+    if (M->_next) return 1;
+    S = M->_link ? M->_link : M;
+    for (n = 1, Y = Y->_next; Y && (n < MACBATCH); n++, Y = Y->_next)
+    {
+	M = Y->_list;
+	if (M->_next || ((M->_link ? M->_link : M) != S)) break;
+    }
+    return n;
+}
+
+
+Outnode *Convlevel::macbatch (Outnode *Y, uint32_t n, uint32_t opi1, uint32_t opi2)
+{
+    uint32_t        c, i, j, k;
+    float           br, bi;
+    Macnode         *M;
+    Outnode         *Z;
+    fftwf_complex   *fftb;
+    fftwf_complex   *A [MACBATCH];
+    fftwf_complex   *D [MACBATCH];
+    Inpnode         *X [MACBATCH];
+
+    // Multiply the input spectra of n outputs by their shared filter,
+    // so each filter partition is read only once per cycle.
+    M = Y->_list->_link ? Y->_list->_link : Y->_list;
+    for (c = 0, Z = Y; c < n; c++, Z = Z->_next)
+    {
+	X [c] = Z->_list->_inpn;
+	D [c] = _mac_data + c * (_parsize + 4);
+	memset (D [c], 0, (_parsize + 1) * sizeof (fftwf_complex));
+    }
+    i = _ptind;
+    for (j = 0; j < _npar; j++)
+    {
+	fftb = M->_fftb [j];
+	if (fftb)
+	{
+	    for (c = 0; c < n; c++) A [c] = X [c]->_ffta [i];
+#ifdef ENABLE_VECTOR_MODE
+	    if (_options & OPT_VECTOR_MODE)
+	    {
+		FV4 *B = (FV4 *) fftb;
+		for (k = 0; k < _parsize / 2; k += 2)
+		{
+		    FV4 b0 = B [k];
+		    FV4 b1 = B [k + 1];
+		    for (c = 0; c < n; c++)
+		    {
+			FV4 *P = (FV4 *)(A [c]) + k;
+			FV4 *Q = (FV4 *)(D [c]) + k;
+			Q [0] += P [0] * b0 - P [1] * b1;
+			Q [1] += P [0] * b1 + P [1] * b0;
+		    }
+		}
+		for (c = 0; c < n; c++) D [c][_parsize][0] += A [c][_parsize][0] * fftb [_parsize][0];
+	    }
+	    else
+#endif
+	    {
+		for (k = 0; k <= _parsize; k++)
+		{
+		    br = fftb [k][0];
+		    bi = fftb [k][1];
+		    for (c = 0; c < n; c++)
+		    {
+			D [c][k][0] += A [c][k][0] * br - A [c][k][1] * bi;
+			D [c][k][1] += A [c][k][0] * bi + A [c][k][1] * br;
+		    }
+		}
+	    }
 	}
+	if (i == 0) i = _npar;
+	i--;
+    }
+    for (c = 0; c < n; c++)
+    {
+	outfft (Y, D [c], opi1, opi2);
+	Y = Y->_next;
     }
+    return Y;
+}
 
-    _ptind++;
-    if (_ptind == _npar) _ptind = 0;
+
+void Convlevel::outfft (Outnode *Y, fftwf_complex *F, uint32_t opi1, uint32_t opi2)
+{
+    uint32_t  k;
+    float     *outd;
+
+    uint64_t  t0 = 0;
+
+    if (_options & OPT_LEVEL_STATS) t0 = nsecs ();
+#ifdef ENABLE_VECTOR_MODE
+    if (_options & OPT_VECTOR_MODE) fftswap (F);
+#endif
+    fftwf_execute_dft_c2r (_plan_c2r, F, _time_data);
+    if (_options & OPT_LEVEL_STATS) _tc2r += nsecs () - t0;
+    outd = Y->_buff [opi1];
+    for (k = 0; k < _parsize; k++) outd [k] += _time_data [k];
+    outd = Y->_buff [opi2];
+    memcpy (outd, _time_data + _parsize, _parsize * sizeof (float));
 }
 
 
@@ -816,11 +1540,13 @@ int Convlevel::readout (bool sync, uint32_t skipcnt)
 	    {
 		if (sync) _done.wait ();
 		else if (_done.trywait ()) break;
-  	        _wait--;
+  	        ST_STORE (_wait, _wait - 1);
 	    }
 	    if (++_opind == 3) _opind = 0;
             _trig.post ();
-	    _wait++;
+	    ST_STORE (_wait, _wait + 1);
+	    if (_wait > 1) ST_STORE (_st_nlate, _st_nlate + 1);
+	    if (_wait > _st_maxwait) ST_STORE (_st_maxwait, _wait);
 	}
         else
 	{
@@ -846,6 +1572,23 @@ void Convlevel::print (FILE *F)
 }
 
 
+void Convlevel::stats (Convstats *S)
+{
+    uint32_t  i;
+
+    S->parsize = _parsize;
+    S->npar = _npar;
+    S->ncycle = ST_LOAD (_st_ncycle);
+    S->nlate = ST_LOAD (_st_nlate);
+    S->wait = ST_LOAD (_wait);
+    S->maxwait = ST_LOAD (_st_maxwait);
+    S->tfft = 1e-9 * ST_LOAD (_st_tfft);
+    S->tmac = 1e-9 * ST_LOAD (_st_tmac);
+    S->tmax = 1e-9 * ST_LOAD (_st_tmax);
+    for (i = 0; i < Convstats::NHIST; i++) S->hist [i] = ST_LOAD (_st_hist [i]);
+}
+
+
 Macnode *Convlevel::findmacnode (uint32_t inp, uint32_t out, bool create)
 {
     Inpnode   *X;
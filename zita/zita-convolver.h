@@ -25,6 +25,11 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <fftw3.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 
 #define ZITA_CONVOLVER_MAJOR_VERSION 4
@@ -148,6 +153,104 @@ private:
 #endif
 
 
+// On Linux the level threads are triggered using a counting semaphore
+// built on atomics, which spins for a short while (on SMP systems)
+// before sleeping on a futex. A post() with no sleeping waiter and a successful trywait()
+// need no system call. Define ZCSYNC_USE_SEMA to use ZCsema instead.
+
+#if defined(__linux__) && !defined(ZCSYNC_USE_SEMA)
+
+class ZCfutex
+{
+public:
+
+    enum { SPINCNT = 256 };
+
+    ZCfutex (void) { init (0, 0); }
+    ~ZCfutex (void) {}
+
+    ZCfutex (const ZCfutex&); // disabled
+    ZCfutex& operator= (const ZCfutex&); // disabled
+
+    int init (int s, int v)
+    {
+	_op_wait = s ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+	_op_wake = s ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+	__atomic_store_n (&_waiters, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n (&_count, v, __ATOMIC_SEQ_CST);
+	return 0;
+    }
+
+    int post (void)
+    {
+	__atomic_fetch_add (&_count, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&_waiters, __ATOMIC_SEQ_CST) > 0)
+	{
+	    syscall (SYS_futex, &_count, _op_wake, 1, 0, 0, 0);
+	}
+	return 0;
+    }
+
+    int wait (void)
+    {
+	int i, n, v;
+
+	n = spincount ();
+	for (i = 0; i < n; i++)
+	{
+	    if (trywait () == 0) return 0;
+#if defined(__i386__) || defined(__x86_64__)
+	    __builtin_ia32_pause ();
+#endif
+	}
+	while (trywait ())
+	{
+	    // Announce the sleeper before checking the count again,
+	    // so that a concurrent post() either sees it or we see
+	    // the new count and the futex wait returns at once.
+	    __atomic_fetch_add (&_waiters, 1, __ATOMIC_SEQ_CST);
+	    v = __atomic_load_n (&_count, __ATOMIC_SEQ_CST);
+	    if (v <= 0) syscall (SYS_futex, &_count, _op_wait, v, 0, 0, 0);
+	    __atomic_fetch_sub (&_waiters, 1, __ATOMIC_SEQ_CST);
+	}
+	return 0;
+    }
+
+    int trywait (void)
+    {
+	int v = __atomic_load_n (&_count, __ATOMIC_SEQ_CST);
+	while (v > 0)
+	{
+	    if (__atomic_compare_exchange_n (&_count, &v, v - 1, false,
+					     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return 0;
+	}
+	return -1;
+    }
+
+private:
+
+    // Spinning only makes sense if the poster can run meanwhile.
+    static int spincount (void)
+    {
+	static const int n = (sysconf (_SC_NPROCESSORS_ONLN) > 1) ? SPINCNT : 0;
+	return n;
+    }
+
+    int  _count;
+    int  _waiters;
+    int  _op_wait;
+    int  _op_wake;
+};
+
+typedef ZCfutex ZCsync;
+
+#else
+
+typedef ZCsema ZCsync;
+
+#endif
+
+
 // ----------------------------------------------------------------------------
 
 
@@ -174,6 +277,7 @@ class Macnode
 private:
 
     friend class Convlevel;
+    friend class Convproc;
 
     Macnode (Inpnode *inpn);
     ~Macnode (void);
@@ -223,6 +327,134 @@ private:
 };
 
 
+// Process-wide cache of FFTW plan pairs, shared by all Convlevel
+// instances using the same FFT size and planner flags. The plans
+// are only ever used via the new-array execute functions, on arrays
+// allocated by fftwf_alloc_*(). Entries are reference counted, and
+// unused ones are kept until purge() so that repeatedly creating
+// Convprocs of the same shape does not re-plan.
+
+class Convplan
+{
+public:
+
+    static int  acquire (uint32_t    size,
+                         int         flags,
+                         fftwf_plan *plan_r2c,
+                         fftwf_plan *plan_c2r);
+
+    static void release (fftwf_plan plan_r2c);
+
+    static void purge (void);
+
+private:
+
+    Convplan (uint32_t size, int flags);
+    ~Convplan (void);
+
+    Convplan           *_next;
+    uint32_t            _size;
+    int                 _flags;
+    int                 _refc;
+    fftwf_plan          _plan_r2c;
+    fftwf_plan          _plan_c2r;
+
+    static Convplan        *_list;
+    static pthread_mutex_t  _mutex;
+};
+
+
+// Runs the worker loop of each Convlevel. The default, when no
+// executor is set on a Convproc, is a new detached thread per level.
+// A job runs until its level is stopped, so an executor must provide
+// one thread for each concurrently running level.
+
+class Convexec
+{
+public:
+
+    virtual ~Convexec (void) {}
+
+    // Run func (arg) with the given scheduling policy and priority,
+    // prio being relative (<= 0) to the absolute priority abspri.
+    virtual int execute (void *(*func)(void *),
+                         void *arg,
+                         int   prio,
+                         int   abspri,
+                         int   policy) = 0;
+};
+
+
+// Executor with persistent worker threads, which can be shared by
+// any number of Convprocs. Threads are created on demand and reused
+// when a level stops. The pool must outlive all Convprocs using it.
+
+class Convpool : public Convexec
+{
+public:
+
+    Convpool (void);
+    virtual ~Convpool (void);
+
+    // Use this policy and absolute priority for all jobs, instead of
+    // the ones given to Convproc::start_process(). E.g. SCHED_IDLE
+    // to run offline work without disturbing realtime clients.
+    void set_sched (int policy, int abspri);
+
+    // Restrict worker threads to the given CPUs. With ncpu == 0 no
+    // affinity is applied, threads keep the one they have.
+    int set_affinity (uint32_t ncpu, const int *cpus);
+
+    uint32_t nthreads (void) const { return _nthr; }
+
+    virtual int execute (void *(*func)(void *),
+                         void *arg,
+                         int   prio,
+                         int   abspri,
+                         int   policy);
+
+private:
+
+    class Worker;
+
+    Convpool (const Convpool&); // disabled
+    Convpool& operator= (const Convpool&); // disabled
+
+    static void *static_main (void *arg);
+
+    Worker             *_list;           // linked list of all workers
+    uint32_t            _nthr;           // number of workers
+    int                 _policy;         // forced policy, or -1
+    int                 _abspri;         // forced priority
+    bool                _setaff;         // use _cpus
+#if defined(__linux__)
+    cpu_set_t           _cpus;           // affinity of workers
+#endif
+    pthread_mutex_t     _mutex;
+};
+
+
+// Per-level statistics, see Convproc::stats(). Times are collected
+// only if the OPT_LEVEL_STATS option is set.
+
+struct Convstats
+{
+    enum { NHIST = 16 };
+
+    uint32_t  parsize;          // partition size
+    uint32_t  npar;             // number of partitions
+    uint64_t  ncycle;           // number of cycles processed
+    uint64_t  nlate;            // number of cycles not ready in time
+    int32_t   wait;             // current number of unfinished cycles
+    int32_t   maxwait;          // largest number of unfinished cycles
+    double    tfft;             // total time in forward and inverse FFTs [s]
+    double    tmac;             // total time in multiply-accumulate [s]
+    double    tmax;             // longest cycle [s]
+    uint64_t  hist [NHIST];     // cycles taking [2^k, 2^(k+1)) microseconds,
+                                // bin 0 is [0, 2), the last one open-ended
+};
+
+
 class Convlevel
 {
 private:
@@ -233,7 +465,13 @@ private:
     {
         OPT_FFTW_MEASURE = 1,
         OPT_VECTOR_MODE  = 2,
-        OPT_LATE_CONTIN  = 4
+        OPT_LATE_CONTIN  = 4,
+        OPT_LEVEL_STATS  = 8
+    };
+
+    enum
+    {
+        MACBATCH = 4
     };
 
     enum
@@ -260,6 +498,19 @@ private:
                         int32_t   ind1,
                         bool      create);
 
+    Macnode *impdata_alloc (uint32_t  inp,
+                            uint32_t  out,
+                            int32_t   ind0,
+                            int32_t   ind1);
+
+    void impdata_part (fftwf_complex  *fftb,
+                       float          *data,
+                       int32_t         step,
+                       int32_t         i0,
+                       int32_t         n,
+                       float          *prep,
+                       fftwf_complex  *freq);
+
     void impdata_clear (uint32_t  inp,
 	                uint32_t  out);
 
@@ -273,7 +524,7 @@ private:
 	        float     **inpbuff,
 	        float     **outbuff);
 
-    void start (int absprio, int policy);
+    void start (int absprio, int policy, Convexec *exec);
 
     void process (bool sync);
 
@@ -285,8 +536,18 @@ private:
 
     void fftswap (fftwf_complex *p);
 
+    void macpart (fftwf_complex *D, fftwf_complex *A, fftwf_complex *B);
+
+    uint32_t findbatch (Outnode *Y);
+
+    Outnode *macbatch (Outnode *Y, uint32_t n, uint32_t opi1, uint32_t opi2);
+
+    void outfft (Outnode *Y, fftwf_complex *F, uint32_t opi1, uint32_t opi2);
+
     void print (FILE *F);
 
+    void stats (Convstats *S);
+
     static void *static_main (void *arg);
 
     void main (void);
@@ -309,8 +570,8 @@ private:
     int                 _bits;           // bit identifiying this level
     int                 _wait;           // number of unfinished cycles
     pthread_t           _pthr;           // posix thread executing this level
-    ZCsema              _trig;           // sema used to trigger a cycle
-    ZCsema              _done;           // sema used to wait for a cycle
+    ZCsync              _trig;           // sema used to trigger a cycle
+    ZCsync              _done;           // sema used to wait for a cycle
     Inpnode            *_inp_list;       // linked list of active inputs
     Outnode            *_out_list;       // linked list of active outputs
     fftwf_plan          _plan_r2c;       // FFTW plan, forward FFT
@@ -318,8 +579,17 @@ private:
     float              *_time_data;      // workspace
     float              *_prep_data;      // workspace
     fftwf_complex      *_freq_data;      // workspace
+    fftwf_complex      *_mac_data;       // workspace, batched MAC
     float             **_inpbuff;        // array of shared input buffers
     float             **_outbuff;        // array of shared output buffers
+    uint64_t            _tc2r;           // inverse FFT time in current cycle
+    uint64_t            _st_ncycle;      // statistics, see Convstats
+    uint64_t            _st_nlate;
+    int32_t             _st_maxwait;
+    uint64_t            _st_tfft;        // [ns]
+    uint64_t            _st_tmac;        // [ns]
+    uint64_t            _st_tmax;        // [ns]
+    uint64_t            _st_hist [Convstats::NHIST];
 };
 
 
@@ -351,7 +621,8 @@ public:
     {
         OPT_FFTW_MEASURE = Convlevel::OPT_FFTW_MEASURE, 
         OPT_VECTOR_MODE  = Convlevel::OPT_VECTOR_MODE,
-        OPT_LATE_CONTIN  = Convlevel::OPT_LATE_CONTIN
+        OPT_LATE_CONTIN  = Convlevel::OPT_LATE_CONTIN,
+        OPT_LEVEL_STATS  = Convlevel::OPT_LEVEL_STATS
     };
 
     enum
@@ -363,7 +634,8 @@ public:
 	MAXPART  = 8192,
 	MAXDIVIS = 16,
 	MINQUANT = 16,
-	MAXQUANT = 8192
+	MAXQUANT = 8192,
+	NCOST    = 14
     };
 
     uint32_t state (void) const
@@ -381,6 +653,17 @@ public:
 	return _outbuff [out] + _outoffs;
     }
 
+    // Measure the relative cost of FFT and MAC per partition on
+    // this host, for all sizes from minpart to maxpart, using the
+    // current options. Call before configure() to affect the
+    // partitioning. Results are kept until the object is deleted.
+    int calibrate (uint32_t  minpart,
+                   uint32_t  maxpart);
+
+    float fftcost (uint32_t size) const;
+
+    void set_fftcost (uint32_t size, float cost);
+
     int configure (uint32_t  ninp,
                    uint32_t  nout,
                    uint32_t  maxsize,
@@ -396,6 +679,18 @@ public:
                         int32_t   ind0,
                         int32_t   ind1); 
 
+    // Load nchan impulse responses from interleaved data, channel c
+    // going to (inp [c], out [c]), like impdata_create() with step
+    // equal to nchan. The partitions are transformed by nthr threads,
+    // or one per CPU if nthr is zero.
+    int impdata_load (uint32_t   nchan,
+                      uint32_t  *inp,
+                      uint32_t  *out,
+                      float     *data,
+                      int32_t    ind0,
+                      int32_t    ind1,
+                      uint32_t   nthr = 0);
+
     int impdata_clear (uint32_t  inp,
 	               uint32_t  out);
 
@@ -424,6 +719,9 @@ public:
 
     void set_skipcnt (uint32_t skipcnt);
 
+    // Use exec to run the level threads, or 0 for the default.
+    void set_executor (Convexec *exec);
+
     int  reset (void);
 
     int  start_process (int abspri, int policy);
@@ -438,8 +736,16 @@ public:
 
     void print (FILE *F = stdout);
 
+    uint32_t nlevels (void) const { return _nlevels; }
+
+    // Copy the statistics of level lev. Can be used from any thread
+    // while processing, the fields are read individually.
+    int stats (uint32_t lev, Convstats *S) const;
+
 private:
 
+    static void *static_load (void *arg);
+
     uint32_t    _state;                   // current state
     float      *_inpbuff [MAXINP];        // input buffers
     float      *_outbuff [MAXOUT];        // output buffers
@@ -456,6 +762,8 @@ private:
     uint32_t    _inpsize;                 // size of input buffers
     uint32_t    _latecnt;                 // count of cycles ending too late
     Convlevel  *_convlev [MAXLEV];        // array of processors 
+    float       _fftcost [NCOST];         // measured FFT cost per log2 (size)
+    Convexec   *_exec;                    // runs the level threads
     void       *_dummy [64];
 
     static float  _mac_cost;